@@ -22,31 +22,71 @@
 
 #include <avr/interrupt.h>
 #include <avr/io.h>
+#include <avr/power.h>
 #include "USI_TWI_Slave.h"
+#include "diag.h"
 
 /*! Static Variables
+ * The fast overflow isr in USI_TWI_Slave_fast.S needs them at link level.
  */
-
-static unsigned char TWI_slaveAddress;
+#ifdef USI_TWI_FAST_ISR
+#define USI_TWI_SHARED
+#define USI_TWI_Overflow_State GPIOR0
+#else
+#define USI_TWI_SHARED static
 static volatile unsigned char USI_TWI_Overflow_State;
-static volatile unsigned char recv_byte_counter = 0;
+#endif
+
+USI_TWI_SHARED unsigned char TWI_slaveAddress;
+USI_TWI_SHARED volatile unsigned char recv_byte_counter = 0;
 /*! Local variables
  */
-static rxbuffer_union_t *TWI_RxBuf;
-static volatile uint8_t TWI_RxHead;
+USI_TWI_SHARED uint8_t TWI_RxQueue[TWI_RX_QUEUE_SIZE];	// write frames, see USI_TWI_Slave.h
+USI_TWI_SHARED volatile uint8_t TWI_RxHead;	// end of the last complete frame, free running
+USI_TWI_SHARED volatile uint8_t TWI_RxTail;	// oldest frame, free running, main only
+USI_TWI_SHARED volatile uint8_t TWI_RxRoom;	// longest frame that fits, set with the address
+USI_TWI_SHARED volatile uint8_t TWI_RxDropped;	// frames lost to a full queue, wraps
+#ifndef USI_TWI_FAST_ISR
+static volatile uint8_t TWI_RxGeneral;	// frame came by general call (GPIOR1 in the fast isr)
+static volatile uint8_t TWI_ReadSeen;	// read since USI_TWI_Read_Seen() (GPIOR1 in the fast isr)
+#endif
+
+USI_TWI_SHARED txbuffer_union_t *TWI_TxBuf;	// register file
+USI_TWI_SHARED volatile uint8_t TWI_RegPtr;	// register pointer, like a 24Cxx address counter
+
+USI_TWI_SHARED uint8_t TWI_Fifo[TWI_FIFO_SIZE];
+USI_TWI_SHARED volatile uint8_t TWI_FifoTail;	// next byte to send
+USI_TWI_SHARED volatile uint8_t TWI_FifoCount;	// bytes in the fifo
+
+USI_TWI_SHARED uint8_t TWI_Snap[2 * TWI_SNAP_SIZE];
+USI_TWI_SHARED volatile uint8_t TWI_SnapPub;	// offset of the published snapshot
+USI_TWI_SHARED volatile uint8_t TWI_SnapRead;	// offset latched by the current read
 
-static txbuffer_union_t *TWI_TxBuf;
-static volatile uint8_t TWI_TxHead;
+#define TWI_RX_GENERAL 0x80	// frame header: came by general call
 
-static uint8_t TX_start = 0, RX_start = 0;
+#ifdef TWI_DIAG
+USI_TWI_SHARED uint8_t TWI_DiagRxOverflow;	// frame longer than the rx buffer, NACKed
+static uint8_t TWI_DiagAborted;				// start condition in the middle of a byte
+static uint8_t TWI_DiagMaxStart;			// longest start condition isr, timer0 ticks
+static uint8_t TWI_DiagMaxOvf;				// longest overflow isr, C isr only
+#endif
 
 /*! \brief Flushes the TWI buffers
  */
 void Flush_TWI_Buffers(void) {
-	//    TWI_RxTail = 0;
-	TWI_RxHead = RX_start;
-	//    TWI_TxTail = 0;
-	TWI_TxHead = TX_start;
+	recv_byte_counter = 0;
+	TWI_RxHead = 0;
+	TWI_RxTail = 0;
+	TWI_RegPtr = 0;
+	TWI_FifoTail = 0;
+	TWI_FifoCount = 0;
+	TWI_SnapPub = 0;
+	TWI_SnapRead = 0;
+#ifdef USI_TWI_FAST_ISR
+	GPIOR1 = 0;
+#else
+	TWI_ReadSeen = 0;
+#endif
 }
 
 //********** USI_TWI functions **********//
@@ -54,9 +94,7 @@ void Flush_TWI_Buffers(void) {
 /*! \brief
  * Initialise USI for TWI Slave mode.
  */
-void USI_TWI_Slave_Initialise(unsigned char TWI_ownAddress, rxbuffer_union_t *RxBuf,
-		txbuffer_union_t *TxBuf) {
-	TWI_RxBuf = RxBuf;
+void USI_TWI_Slave_Initialise(unsigned char TWI_ownAddress, txbuffer_union_t *TxBuf) {
 	TWI_TxBuf = TxBuf;
 	Flush_TWI_Buffers();
 
@@ -74,23 +112,161 @@ void USI_TWI_Slave_Initialise(unsigned char TWI_ownAddress, rxbuffer_union_t *Rx
 	USISR = 0xF0; // Clear all flags and reset overflow counter
 }
 
-// Select TX buffer start address
-void USI_TWI_Set_TX_Start(uint8_t start) {
-	TX_start = start;
+/*! \brief Queue the frame in progress. Isr or interrupts off.
+ */
+static void Rx_Commit(void) {
+	uint8_t head = TWI_RxHead;
+
+#ifdef USI_TWI_FAST_ISR
+	TWI_RxQueue[head & TWI_RX_QUEUE_MASK] = recv_byte_counter
+			| (GPIOR1 & (1 << USI_FLAG_GENERAL) ? TWI_RX_GENERAL : 0);
+#else
+	TWI_RxQueue[head & TWI_RX_QUEUE_MASK] = recv_byte_counter
+			| (TWI_RxGeneral ? TWI_RX_GENERAL : 0);
+#endif
+	TWI_RxHead = head + recv_byte_counter + 1;
+	recv_byte_counter = 0;
 }
 
-/*! \brief Check if there is data in the receive buffer.
+/*! \brief Check for a complete write frame.
+ * Returns the length (register pointer plus data bytes) of the oldest
+ * queued frame or -1. A frame is complete on the stop condition or on a
+ * repeated start. Pointer-only frames (set up for a read) are not queued.
  */
 char USI_TWI_Data_In_Receive_Buffer(void) {
-	uint8_t tmp;
-	if (recv_byte_counter < 3)
+	// USIPF is cleared on every byte, so once data was received it can only
+	// be set by the stop condition ending this frame
+	cli();
+	if (recv_byte_counter > 1 && (USISR & (1 << USIPF)))
+		Rx_Commit();
+	sei();
+
+	if (TWI_RxTail == TWI_RxHead)
 		return -1;
 
-	recv_byte_counter = 0;
-	tmp = RX_start;
-	RX_start = (RX_start + 4) & TWI_RX_BUFFER_MASK;
+	return TWI_RxQueue[TWI_RxTail & TWI_RX_QUEUE_MASK] & ~TWI_RX_GENERAL;
+}
+
+/*! \brief Byte i of the oldest frame, 0 is the register pointer.
+ */
+uint8_t USI_TWI_Receive_Byte(uint8_t i) {
+	return TWI_RxQueue[(TWI_RxTail + 1 + i) & TWI_RX_QUEUE_MASK];
+}
+
+/*! \brief Was the oldest frame sent to the general call address?
+ */
+uint8_t USI_TWI_General_Call(void) {
+	return TWI_RxQueue[TWI_RxTail & TWI_RX_QUEUE_MASK] & TWI_RX_GENERAL;
+}
+
+/*! \brief Write frames lost to a full queue so far, wraps.
+ */
+uint8_t USI_TWI_Rx_Dropped(void) {
+	return TWI_RxDropped;
+}
+
+/*! \brief Was this slave addressed for reading since the last call?
+ * Clears the flag.
+ */
+uint8_t USI_TWI_Read_Seen(void) {
+#ifdef USI_TWI_FAST_ISR
+	if (!(GPIOR1 & (1 << USI_FLAG_READ)))
+		return 0;
+	GPIOR1 &= ~(1 << USI_FLAG_READ); // cbi, the isr may set other flags
+#else
+	if (!TWI_ReadSeen)
+		return 0;
+	TWI_ReadSeen = 0;
+#endif
+	return 1;
+}
+
+/*! \brief Change the own slave address, effective with the next start condition.
+ */
+void USI_TWI_Slave_Address(unsigned char TWI_ownAddress) {
+	TWI_slaveAddress = TWI_ownAddress;
+}
+
+/*! \brief Drop the oldest frame, its room goes back to the USI ISR.
+ */
+void USI_TWI_Release_Receive_Buffer(void) {
+	uint8_t tail = TWI_RxTail;
+
+	TWI_RxTail = tail + (TWI_RxQueue[tail & TWI_RX_QUEUE_MASK] & ~TWI_RX_GENERAL) + 1;
+}
+
+/*! \brief Append one entry to the history FIFO.
+ * When the FIFO is full the oldest entry (of the same length) is dropped,
+ * together with what is left of an entry a read stopped in the middle of,
+ * so the tail is back on an entry boundary.
+ */
+void USI_TWI_FIFO_Put(const uint8_t *data, uint8_t len) {
+	uint8_t head, i, drop;
+
+	cli();
+	if (TWI_FifoCount > TWI_FIFO_SIZE - len) {
+		drop = len + TWI_FifoCount % len; // the head is always on a boundary
+		TWI_FifoTail += drop;
+		if (TWI_FifoTail >= TWI_FIFO_SIZE)
+			TWI_FifoTail -= TWI_FIFO_SIZE;
+		TWI_FifoCount -= drop;
+	}
+	head = TWI_FifoTail + TWI_FifoCount; // stays put while the isr pops
+	sei();
+
+	// the isr only reads below tail + count, so the copy can run with interrupts on
+	for (i = 0; i < len; i++) {
+		if (head >= TWI_FIFO_SIZE)
+			head -= TWI_FIFO_SIZE;
+		TWI_Fifo[head++] = data[i];
+	}
+
+	cli();
+	TWI_FifoCount += len;
+	sei();
+}
+
+/*! \brief Bytes waiting in the history FIFO.
+ */
+uint8_t USI_TWI_FIFO_Count(void) {
+	return TWI_FifoCount;
+}
+
+/*! \brief Snapshot buffer to fill next, 0 while a read still uses it.
+ * Fill all TWI_SNAP_SIZE bytes, then call USI_TWI_Snapshot_Publish().
+ */
+uint8_t *USI_TWI_Snapshot_Buffer(void) {
+	uint8_t next = TWI_SNAP_SIZE - TWI_SnapPub;
 
-	return tmp;
+	// a read latched before the last publish may still be on it. New reads
+	// latch the published one, so this can't change after the check.
+	if (TWI_SnapRead == next && !USI_TWI_Bus_Idle())
+		return 0;
+	return &TWI_Snap[next];
+}
+
+/*! \brief Swap the snapshot buffers, single byte write.
+ */
+void USI_TWI_Snapshot_Publish(void) {
+	TWI_SnapPub = TWI_SNAP_SIZE - TWI_SnapPub;
+}
+
+#ifdef TWI_DIAG
+/*! \brief Copy the counters in REG_DIAG_RX_OVERFLOW order.
+ */
+void USI_TWI_Diag(uint8_t *d) {
+	d[0] = TWI_DiagRxOverflow;
+	d[1] = TWI_DiagAborted;
+	d[2] = TWI_DiagMaxStart;
+	d[3] = TWI_DiagMaxOvf;
+}
+#endif
+
+/*! \brief No transfer in progress.
+ * True before the first start condition, after a NACK and after a stop.
+ */
+uint8_t USI_TWI_Bus_Idle(void) {
+	return !(USICR & (1 << USIOIE)) || (USISR & (1 << USIPF));
 }
 
 /*! \brief Usi start condition ISR
@@ -100,24 +276,52 @@ char USI_TWI_Data_In_Receive_Buffer(void) {
 
 ISR(USI_START_VECTOR)
 {
+#ifdef USI_TWI_CLOCK_DIV
+	clock_prescale_set(USI_TWI_CLOCK_DIV); // back to full speed first
+#endif
+	DIAG_ENTER();
+#ifdef TWI_DIAG
+	// a repeated start follows one rising SCL edge, more means a byte was cut
+	if ((USICR & (1 << USIOIE)) && !(USISR & (1 << USIPF)) && (USISR & 0x0F) > 1)
+		TWI_DiagAborted++;
+#endif
 	//unsigned char tmpUSISR;                                         // Temporary variable to store volatile
 	//tmpUSISR = USISR;                                               // Not necessary, but prevents warnings
 	// Set default starting conditions for new TWI package
+	if (recv_byte_counter > 1) // write frame ended by a repeated start
+		Rx_Commit();
 	USI_TWI_Overflow_State = USI_SLAVE_CHECK_ADDRESS;
 	DDR_USI &= ~(1 << PORT_USI_SDA); // Set SDA as input
-	while ((PIN_USI & (1 << PORT_USI_SCL)) & !(USISR & (1 << USIPF)))
-		; // Wait for SCL to go low to ensure the "Start Condition" has completed.
-	// If a Stop condition arises then leave the interrupt to prevent waiting forever.
 
-	USICR = (1 << USISIE) | (1 << USIOIE) | // Enable Overflow and Start Condition Interrupt. (Keep StartCondInt to detect RESTART)
-			(1 << USIWM1) | (1 << USIWM0) | // Set USI in Two-wire mode.
-			(1 << USICS1) | (0 << USICS0) | (0 << USICLK) | // Shift Register Clock Source = External, positive edge
-			(0 << USITC);
-	USISR = (1 << USI_START_COND_INT) | (1 << USIOIF) | (1 << USIPF) | (1
-			<< USIDC) | // Clear flags
-			(0x0 << USICNT0); // Set USI to sample 8 bits i.e. count 16 external pin toggles.
+	// The "Start Condition" is complete once SCL is low. Instead of waiting for
+	// that here (and blocking the heater isrs), preset the counter so the SCL
+	// falling edge overflows it, USI_SLAVE_WAIT_START then continues. USISIF
+	// is left set with its interrupt off, so the start detector holds SCL low
+	// from that edge on and nothing can get lost in between.
+	// The latency this saves the heater edges has not been measured, on the
+	// chip REG_DIAG_MAX_START (TWI_DIAG) shows what this isr takes now.
+	if (PIN_USI & (1 << PIN_USI_SCL)) {
+		USI_TWI_Overflow_State = USI_SLAVE_WAIT_START;
+		USICR = (0 << USISIE) | (1 << USIOIE) | // Overflow Interrupt only
+				(1 << USIWM1) | (1 << USIWM0) | // Set USI in Two-wire mode.
+				(1 << USICS1) | (0 << USICS0) | (0 << USICLK) | // Shift Register Clock Source = External, positive edge
+				(0 << USITC);
+		USISR = (0 << USI_START_COND_INT) | (1 << USIOIF) | (1 << USIPF) | (1
+				<< USIDC) | // Clear flags, except Start Cond
+				(0x0F << USICNT0); // overflow on the next edge
+		if ((PIN_USI & (1 << PIN_USI_SCL)) || (USISR & (1 << USIOIF))) {
+			DIAG_LEAVE(TWI_DiagMaxStart);
+			return;
+		}
+		// SCL fell just before the counter was set and is held low now
+		USI_TWI_Overflow_State = USI_SLAVE_CHECK_ADDRESS;
+	}
+
+	SET_USI_TO_RECEIVE_ADDRESS();
+	DIAG_LEAVE(TWI_DiagMaxStart);
 }
 
+#ifndef USI_TWI_FAST_ISR
 /*! \brief USI counter overflow ISR
  * Handels all the comunication. Is disabled only when waiting
  * for new Start Condition.
@@ -125,20 +329,32 @@ ISR(USI_START_VECTOR)
 ISR(USI_OVERFLOW_VECTOR)
 {
 	unsigned char tmpUSIDR;
-
+	uint8_t room;
+	DIAG_ENTER();
 
 	switch (USI_TWI_Overflow_State) {
+		// Start Condition completed (SCL low), receive the address byte
+	case USI_SLAVE_WAIT_START:
+		USI_TWI_Overflow_State = USI_SLAVE_CHECK_ADDRESS;
+		SET_USI_TO_RECEIVE_ADDRESS();
+		break;
+
 		// ---------- Address mode ----------
 		// Check address and send ACK (and next USI_SLAVE_SEND_DATA) if OK, else reset USI.
 	case USI_SLAVE_CHECK_ADDRESS:
 		if ((USIDR == 0) || ((USIDR >> 1) == TWI_slaveAddress)) {
 			if (USIDR & 0x01) {
 				USI_TWI_Overflow_State = USI_SLAVE_SEND_DATA;
-				TWI_TxHead = TX_start;
+				TWI_SnapRead = TWI_SnapPub;
+				TWI_ReadSeen = 1;
 			} else {
 				USI_TWI_Overflow_State = USI_SLAVE_REQUEST_DATA;
-				TWI_RxHead = RX_start;
 				recv_byte_counter = 0;
+				TWI_RxGeneral = (USIDR == 0);
+				// keep the header and pointer of the next frame free, the
+				// pointer of this one always fits
+				room = TWI_RX_QUEUE_SIZE - 3 - (uint8_t) (TWI_RxHead - TWI_RxTail);
+				TWI_RxRoom = (int8_t) room < 1 ? 1 : room;
 			}
 			SET_USI_TO_SEND_ACK();
 
@@ -153,14 +369,30 @@ ISR(USI_OVERFLOW_VECTOR)
 		if (USIDR) // If NACK, the master does not want more data.
 		{
 			SET_USI_TO_TWI_START_CONDITION_MODE();
+			DIAG_LEAVE(TWI_DiagMaxOvf);
 			return;
 		}
 		// From here we just drop straight into USI_SLAVE_SEND_DATA if the master sent an ACK
 
 		// Copy data from buffer to USIDR and set USI to shift byte. Next USI_SLAVE_REQUEST_REPLY_FROM_SEND_DATA
 	case USI_SLAVE_SEND_DATA:
-		USIDR = TWI_TxBuf->b[TWI_TxHead];
-		TWI_TxHead = (TWI_TxHead + 1) & TWI_TX_BUFFER_MASK;
+		if (TWI_RegPtr == TWI_FIFO_PORT) {
+			if (TWI_FifoCount) {
+				USIDR = TWI_Fifo[TWI_FifoTail];
+				if (++TWI_FifoTail == TWI_FIFO_SIZE)
+					TWI_FifoTail = 0;
+				TWI_FifoCount--;
+			} else
+				USIDR = 0xFF;
+		} else {
+			if (TWI_RegPtr >= TWI_SNAP_BASE)
+				USIDR = TWI_Snap[TWI_SnapRead + TWI_RegPtr - TWI_SNAP_BASE];
+			else if (TWI_RegPtr >= TWI_REG_FILE_SIZE)
+				USIDR = 0xFF;
+			else
+				USIDR = TWI_TxBuf->b[TWI_RegPtr];
+			TWI_RegPtr = (TWI_RegPtr + 1) & TWI_TX_BUFFER_MASK;
+		}
 
 		USI_TWI_Overflow_State = USI_SLAVE_REQUEST_REPLY_FROM_SEND_DATA;
 		SET_USI_TO_SEND_DATA();
@@ -181,14 +413,31 @@ ISR(USI_OVERFLOW_VECTOR)
 
 		// Copy data from USIDR and send ACK. Next USI_SLAVE_REQUEST_DATA
 	case USI_SLAVE_GET_DATA_AND_SEND_ACK:
-		// Put data into Buffer
+		// Put data into Buffer, the first byte is the register pointer
 		tmpUSIDR = USIDR; // Not necessary, but prevents warnings
-		TWI_RxBuf->b[TWI_RxHead] = tmpUSIDR;
-		TWI_RxHead = (TWI_RxHead + 1) & TWI_RX_BUFFER_MASK;
+		if (recv_byte_counter == TWI_RxRoom) {
+			// no room, NACK, nothing of the frame is queued
+			SET_USI_TO_TWI_START_CONDITION_MODE();
+			if (recv_byte_counter < TWI_RX_BUFFER_SIZE) {
+				TWI_RxDropped++; // queue full
+			} else {
+				DIAG_COUNT(TWI_DiagRxOverflow); // frame too long
+			}
+			recv_byte_counter = 0;
+			DIAG_LEAVE(TWI_DiagMaxOvf);
+			return;
+		}
+		if (recv_byte_counter)
+			TWI_RegPtr = (TWI_RegPtr + 1) & TWI_TX_BUFFER_MASK;
+		else
+			TWI_RegPtr = tmpUSIDR & TWI_TX_BUFFER_MASK;
+		TWI_RxQueue[(TWI_RxHead + 1 + recv_byte_counter) & TWI_RX_QUEUE_MASK] = tmpUSIDR;
 		recv_byte_counter++;
 
 		USI_TWI_Overflow_State = USI_SLAVE_REQUEST_DATA;
 		SET_USI_TO_SEND_ACK();
 		break;
 	}
+	DIAG_LEAVE(TWI_DiagMaxOvf);
 }
+#endif /* USI_TWI_FAST_ISR */
@@ -25,51 +25,139 @@
 #define TRUE                1
 #define FALSE               0
 
+// Build option: use the hand-written overflow ISR in USI_TWI_Slave_fast.S
+// instead of the C state machine. Needs GPIOR0..2. Untested, see the file.
+//#define USI_TWI_FAST_ISR
+
+// Build option: bus error counters and isr run time maxima, readable in the
+// diagnostics block of the register map (registers.h). Costs 18 bytes of
+// SRAM (11 of them register file, 4 in the driver, 3 in main.c) and a few
+// cycles per isr.
+//#define TWI_DIAG
+
+#ifndef __ASSEMBLER__
 typedef unsigned char uint8_t;
+#endif
 
 //////////////////////////////////////////////////////////////////
 ///////////////// Driver Buffer Definitions //////////////////////
 //////////////////////////////////////////////////////////////////
 // 1,2,4,8,16,32,64,128 or 256 bytes are allowed buffer sizes
 
-#define TWI_RX_BUFFER_SIZE  (8)
-#define TWI_RX_BUFFER_MASK ( TWI_RX_BUFFER_SIZE - 1 )
+// Write frames queue up here until the main loop takes them, so a master
+// can send several without waiting in between. Each frame is stored as
+// [length | general call << 7, register pointer, data ...]. The isr keeps
+// room for the header and register pointer of the next frame, so setting
+// up a read always works. A frame that finds no room is NACKed at the
+// first byte that does not fit and dropped (REG_RX_DROPPED).
+// Up to 128 bytes.
 
-#if ( TWI_RX_BUFFER_SIZE & TWI_RX_BUFFER_MASK )
-#error TWI RX buffer size is not a power of 2
+#define TWI_RX_QUEUE_SIZE   (16)
+#define TWI_RX_QUEUE_MASK  ( TWI_RX_QUEUE_SIZE - 1 )
+
+#if ( TWI_RX_QUEUE_SIZE & TWI_RX_QUEUE_MASK ) || TWI_RX_QUEUE_SIZE > 128
+#error TWI RX queue size is not a power of 2 up to 128
 #endif
 
+// longest write frame (register pointer and data), longer ones are NACKed
+// at the first byte too many and dropped. Bootloader pages (boot.h) sent
+// by general call are such frames, so a running application ignores them.
+#define TWI_RX_BUFFER_SIZE  (TWI_RX_QUEUE_SIZE - 3)
+
 // 1,2,4,8,16,32,64,128 or 256 bytes are allowed buffer sizes
 
-#define TWI_TX_BUFFER_SIZE  (8)
+#define TWI_TX_BUFFER_SIZE  (128)
 #define TWI_TX_BUFFER_MASK ( TWI_TX_BUFFER_SIZE - 1 )
 
 #if ( TWI_TX_BUFFER_SIZE & TWI_TX_BUFFER_MASK )
 #error TWI TX buffer size is not a power of 2
 #endif
 
-typedef union {
-	uint8_t b[TWI_RX_BUFFER_SIZE];
-	uint16_t w[TWI_RX_BUFFER_SIZE / 2];
-} rxbuffer_union_t;
+// History FIFO. Reads from register address TWI_FIFO_PORT take bytes out of
+// the FIFO instead of the register file and do not advance the register
+// pointer, so a single burst read drains it. An empty FIFO reads 0xFF.
+// The size must be a multiple of the entry size used with USI_TWI_FIFO_Put().
+
+#define TWI_FIFO_SIZE       (48)
+#define TWI_FIFO_PORT       (0x0F)
+
+// TWI_TX_BUFFER_SIZE is the register address space. The register file in
+// SRAM only covers the first TWI_REG_FILE_SIZE addresses, above it reads
+// 0xFF up to the snapshot window. Addresses TWI_SNAP_BASE ..
+// TWI_TX_BUFFER_SIZE - 1 are read from one of two snapshot buffers. The
+// published buffer is latched with the read address, so a burst read never
+// mixes two snapshots.
+
+#ifdef TWI_DIAG
+#define TWI_REG_FILE_SIZE   (0x5C)
+#else
+#define TWI_REG_FILE_SIZE   (0x51)
+#endif
+#define TWI_SNAP_BASE       (0x74)
+#define TWI_SNAP_SIZE       (TWI_TX_BUFFER_SIZE - TWI_SNAP_BASE)
+
+// System clock prescaler the start condition isr switches to, so that the
+// address byte is served at full speed after the application slowed the
+// clock down. Leave undefined if the clock is never scaled.
+#define USI_TWI_CLOCK_DIV   clock_div_2
 
+#ifndef __ASSEMBLER__
 typedef union {
-	uint8_t b[TWI_TX_BUFFER_SIZE];
-	uint16_t w[TWI_TX_BUFFER_SIZE / 2];
+	uint8_t b[TWI_REG_FILE_SIZE];
+	uint16_t w[TWI_REG_FILE_SIZE / 2];
 } txbuffer_union_t;
 
 
 //! Prototypes
-void USI_TWI_Slave_Initialise(unsigned char, rxbuffer_union_t *, txbuffer_union_t *);
-void USI_TWI_Set_TX_Start(uint8_t);
+void USI_TWI_Slave_Initialise(unsigned char, txbuffer_union_t *);
 char USI_TWI_Data_In_Receive_Buffer(void);
+uint8_t USI_TWI_Receive_Byte(uint8_t);
+void USI_TWI_Release_Receive_Buffer(void);
+uint8_t USI_TWI_General_Call(void);
+uint8_t USI_TWI_Rx_Dropped(void);
+uint8_t USI_TWI_Read_Seen(void);
+void USI_TWI_Slave_Address(unsigned char);
+void USI_TWI_FIFO_Put(const uint8_t *, uint8_t);
+uint8_t USI_TWI_FIFO_Count(void);
+uint8_t USI_TWI_Bus_Idle(void);
+#ifdef TWI_DIAG
+void USI_TWI_Diag(uint8_t *);
+#endif
+uint8_t *USI_TWI_Snapshot_Buffer(void);
+void USI_TWI_Snapshot_Publish(void);
 void Timer_Init(void);
+#endif
+
 
 
 
 
 
+#ifdef USI_TWI_FAST_ISR
+// one-hot, so the naked isr can dispatch with sbic on GPIOR0
+#define USI_SLAVE_CHECK_ADDRESS_BIT                0
+#define USI_SLAVE_SEND_DATA_BIT                    1
+#define USI_SLAVE_REQUEST_REPLY_FROM_SEND_DATA_BIT 2
+#define USI_SLAVE_CHECK_REPLY_FROM_SEND_DATA_BIT   3
+#define USI_SLAVE_REQUEST_DATA_BIT                 4
+#define USI_SLAVE_GET_DATA_AND_SEND_ACK_BIT        5
+#define USI_SLAVE_WAIT_START_BIT                   6
 
+#define USI_SLAVE_CHECK_ADDRESS                (1 << USI_SLAVE_CHECK_ADDRESS_BIT)
+#define USI_SLAVE_SEND_DATA                    (1 << USI_SLAVE_SEND_DATA_BIT)
+#define USI_SLAVE_REQUEST_REPLY_FROM_SEND_DATA (1 << USI_SLAVE_REQUEST_REPLY_FROM_SEND_DATA_BIT)
+#define USI_SLAVE_CHECK_REPLY_FROM_SEND_DATA   (1 << USI_SLAVE_CHECK_REPLY_FROM_SEND_DATA_BIT)
+#define USI_SLAVE_REQUEST_DATA                 (1 << USI_SLAVE_REQUEST_DATA_BIT)
+#define USI_SLAVE_GET_DATA_AND_SEND_ACK        (1 << USI_SLAVE_GET_DATA_AND_SEND_ACK_BIT)
+#define USI_SLAVE_WAIT_START                   (1 << USI_SLAVE_WAIT_START_BIT)
+#define USI_SLAVE_IDLE						   (0x00)
+
+// GPIOR1 flags of the fast isr
+#define USI_FLAG_RX_FULL                       0 // frame reached TWI_RxRoom, NACK further data
+#define USI_FLAG_FIFO_POP                      1 // byte in GPIOR2 was taken from the fifo
+#define USI_FLAG_GENERAL                       2 // write frame came by general call
+#define USI_FLAG_READ                          3 // addressed for reading, see USI_TWI_Read_Seen()
+#else
 #define USI_SLAVE_CHECK_ADDRESS                (0x00)
 #define USI_SLAVE_SEND_DATA                    (0x01)
 #define USI_SLAVE_REQUEST_REPLY_FROM_SEND_DATA (0x02)
@@ -77,6 +165,8 @@ void Timer_Init(void);
 #define USI_SLAVE_REQUEST_DATA                 (0x04)
 #define USI_SLAVE_GET_DATA_AND_SEND_ACK        (0x05)
 #define USI_SLAVE_IDLE						   (0x06)
+#define USI_SLAVE_WAIT_START                   (0x07)
+#endif
 
 //! Device dependent defines
 #if defined(__AT90tiny26__) | defined(__ATtiny26__)
@@ -190,6 +280,16 @@ void Timer_Init(void);
               (0x0<<USICNT0);                                                                                                     \
 }
 
+#define SET_USI_TO_RECEIVE_ADDRESS()                                                                                              \
+{                                                                                                                                 \
+  USICR    =  (1<<USISIE)|(1<<USIOIE)|                        /* Enable Overflow and Start Condition Interrupt. (Keep StartCondInt to detect RESTART) */ \
+              (1<<USIWM1)|(1<<USIWM0)|                        /* Set USI in Two-wire mode.                                    */  \
+              (1<<USICS1)|(0<<USICS0)|(0<<USICLK)|            /* Shift Register Clock Source = External, positive edge        */  \
+              (0<<USITC);                                                                                                         \
+  USISR    =  (1<<USI_START_COND_INT)|(1<<USIOIF)|(1<<USIPF)|(1<<USIDC)|  /* Clear flags                                         */ \
+              (0x0<<USICNT0);                                 /* Set USI to sample 8 bits i.e. count 16 external pin toggles. */  \
+}
+
 #define SET_USI_TO_SEND_DATA()                                                                               \
 {                                                                                                            \
     DDR_USI |=  (1<<PORT_USI_SDA);                                  /* Set SDA as output                  */ \
@@ -0,0 +1,298 @@
+/*
+ * boot.c
+ *
+ * TWI bootloader at BOOT_START, layout and protocol in boot.h. It is not
+ * part of the application build, link it on its own with .text moved up:
+ *
+ *   avr-gcc -mmcu=attiny84 -Os -o boot.elf boot.c \
+ *       -Wl,--section-start=.text=0x1980 -Wl,--section-start=.bootreset=0
+ *
+ * and program it once by ISP, the application then comes over the bus.
+ * The ATtiny84 has no boot section and its only vector table belongs to
+ * the application, so the bootloader runs with interrupts off and polls
+ * the USI. The state machine is the one of USI_TWI_Slave.c with its
+ * macros, without the queue: one frame buffer, applied once the frame
+ * has ended.
+ */
+
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/power.h>
+#include <avr/wdt.h>
+#include <util/crc16.h>
+#include "USI_TWI_Slave.h"
+#include "boot.h"
+
+#if BOOT_PAGE_SIZE != SPM_PAGESIZE || BOOT_START % SPM_PAGESIZE || BOOT_START > FLASHEND
+#error bootloader layout does not match the chip
+#endif
+
+// word 0 of a chip that only has the bootloader
+static const uint16_t bootReset __attribute__((used, section(".bootreset"))) =
+		BOOT_RJMP(0, BOOT_START);
+
+static uint8_t usiState;
+static uint8_t slaveAddress;
+static uint8_t frame[BOOT_FRAME_MAX];
+static uint8_t frameLen;		// bytes received, 0 = none
+static uint8_t frameGeneral;	// came by general call
+static uint8_t stat[BOOT_STAT_SIZE] = { BOOT_ID };
+static uint8_t statPtr;			// read pointer
+
+int main(void) __attribute__((naked));
+
+// crc of a page as it was in the image: word 0 is the stored vector
+static uint16_t page_crc(uint16_t crc, uint8_t page) {
+	uint16_t a = page * BOOT_PAGE_SIZE, v = eeprom_read_word(BOOT_EE_VECT);
+	uint8_t i, c;
+
+	for (i = 0; i < BOOT_PAGE_SIZE; i++) {
+		c = pgm_read_byte(a + i);
+		if (!a && i < 2)
+			c = i ? v >> 8 : v;
+		crc = _crc_ccitt_update(crc, c);
+	}
+	wdt_reset(); // still running after a watchdog reset
+	return crc;
+}
+
+static uint16_t image_crc(uint8_t pages) {
+	uint16_t crc = 0xFFFF;
+	uint8_t p;
+
+	for (p = 0; p < pages; p++)
+		crc = page_crc(crc, p);
+	return crc;
+}
+
+static uint8_t image_ok(void) {
+	uint8_t pages = eeprom_read_byte(BOOT_EE_PAGES);
+
+	return pages && pages <= BOOT_APP_PAGES
+			&& image_crc(pages) == eeprom_read_word(BOOT_EE_CRC);
+}
+
+static void stat_crc(uint16_t crc) {
+	stat[BOOT_STAT_CRC] = crc;
+	stat[BOOT_STAT_CRC + 1] = crc >> 8;
+}
+
+/*! \brief Start the application through the vector of its image.
+ * The USI goes back to its reset state, the application sets up the
+ * rest itself.
+ */
+static void app_start(void) {
+	uint16_t v = eeprom_read_word(BOOT_EE_VECT);
+
+	USICR = 0;
+	USISR = 0xF0;
+	DDR_USI &= ~((1 << PORT_USI_SCL) | (1 << PORT_USI_SDA));
+	PORT_USI &= ~((1 << PORT_USI_SCL) | (1 << PORT_USI_SDA));
+	GPIOR2 = 0;
+	((void (*)(void)) ((v + 1) & (FLASHEND >> 1)))(); // rjmp from word 0
+}
+
+/*! \brief BOOT_CMD_PAGE
+ * Page 0 gets the jump to the bootloader, the vector of the image goes
+ * to eeprom. Any page written makes the image invalid until the next
+ * check.
+ */
+static void page_write(void) {
+	uint8_t page = frame[1], *d = &frame[2], i;
+	uint16_t a = page * BOOT_PAGE_SIZE, crc = 0xFFFF;
+
+	for (i = 1; i < BOOT_FRAME_MAX - 2; i++)
+		crc = _crc_ccitt_update(crc, frame[i]);
+	if (crc != (frame[BOOT_FRAME_MAX - 2] | frame[BOOT_FRAME_MAX - 1] << 8)
+			|| page >= BOOT_APP_PAGES || (!page && (d[1] & 0xF0) != 0xC0)) {
+		stat[BOOT_STAT_ERRORS]++;
+		return;
+	}
+	eeprom_update_byte(BOOT_EE_PAGES, 0xFF);
+	stat[BOOT_STAT_STATE] = BOOT_IDLE;
+	if (!page) {
+		eeprom_update_word(BOOT_EE_VECT, d[0] | d[1] << 8);
+		d[0] = (uint8_t) BOOT_RJMP(0, BOOT_START);
+		d[1] = BOOT_RJMP(0, BOOT_START) >> 8;
+	}
+
+	boot_page_erase(a);
+	boot_spm_busy_wait();
+	for (i = 0; i < BOOT_PAGE_SIZE; i += 2)
+		boot_page_fill(a + i, d[i] | d[i + 1] << 8);
+	boot_page_write(a);
+	boot_spm_busy_wait();
+
+	if (page_crc(_crc_ccitt_update(0xFFFF, page), page) != crc)
+		stat[BOOT_STAT_ERRORS]++; // does not read back
+}
+
+static void frame_done(void) {
+	uint8_t len = frameLen;
+	uint16_t crc;
+
+	frameLen = 0;
+	if (len == 1 && !frameGeneral) {
+		statPtr = frame[0];
+		return;
+	}
+	if (frameGeneral && frame[0] != BOOT_CMD_PAGE)
+		return; // group frames of the application
+
+	switch (frame[0]) {
+	case BOOT_CMD_PAGE:
+		if (len == BOOT_FRAME_MAX)
+			page_write();
+		break;
+
+	case BOOT_CMD_PAGE_CRC:
+		if (frame[1] < BOOT_APP_PAGES)
+			stat_crc(page_crc(_crc_ccitt_update(0xFFFF, frame[1]), frame[1]));
+		break;
+
+	case BOOT_CMD_CHECK:
+		if (len != 4 || !frame[1] || frame[1] > BOOT_APP_PAGES) {
+			stat[BOOT_STAT_STATE] = BOOT_BAD;
+			break;
+		}
+		crc = image_crc(frame[1]);
+		stat_crc(crc);
+		if (crc == (frame[2] | frame[3] << 8)) {
+			eeprom_update_word(BOOT_EE_CRC, crc);
+			eeprom_update_byte(BOOT_EE_PAGES, frame[1]);
+			stat[BOOT_STAT_STATE] = BOOT_VALID;
+		} else {
+			stat[BOOT_STAT_STATE] = BOOT_BAD;
+		}
+		break;
+
+	case BOOT_CMD_RUN:
+		if (frame[1] == BOOT_MAGIC && stat[BOOT_STAT_STATE] == BOOT_VALID)
+			app_start();
+		break;
+	}
+}
+
+/*! \brief The two isrs of USI_TWI_Slave.c, polled.
+ * A write frame is applied when the next start condition or the stop
+ * ends it. The USI holds SCL low after a start until USISIF is cleared,
+ * so a master that goes on meanwhile only gets stretched.
+ */
+static void usi_poll(void) {
+	uint8_t d;
+
+	if (USISR & (1 << USISIF)) {
+		if (frameLen)
+			frame_done();
+		usiState = USI_SLAVE_CHECK_ADDRESS;
+		DDR_USI &= ~(1 << PORT_USI_SDA);
+		// the start condition is complete once SCL is low (or a stop came)
+		while ((PIN_USI & (1 << PIN_USI_SCL)) && !(PIN_USI & (1 << PIN_USI_SDA)))
+			;
+		SET_USI_TO_RECEIVE_ADDRESS();
+		return;
+	}
+	if (frameLen && (USISR & (1 << USIPF))) {
+		frame_done();
+		SET_USI_TO_TWI_START_CONDITION_MODE();
+		return;
+	}
+	if (!(USISR & (1 << USIOIF)))
+		return;
+
+	switch (usiState) {
+	case USI_SLAVE_CHECK_ADDRESS:
+		d = USIDR;
+		if (!d || (d >> 1) == slaveAddress) {
+			if (d & 0x01) {
+				usiState = USI_SLAVE_SEND_DATA;
+			} else {
+				usiState = USI_SLAVE_REQUEST_DATA;
+				frameLen = 0;
+				frameGeneral = !d;
+			}
+			SET_USI_TO_SEND_ACK();
+		} else {
+			SET_USI_TO_TWI_START_CONDITION_MODE();
+		}
+		break;
+
+	case USI_SLAVE_CHECK_REPLY_FROM_SEND_DATA:
+		if (USIDR) { // NACK, the master is done
+			SET_USI_TO_TWI_START_CONDITION_MODE();
+			break;
+		}
+		// fall through
+	case USI_SLAVE_SEND_DATA:
+		USIDR = statPtr < BOOT_STAT_SIZE ? stat[statPtr] : 0xFF;
+		statPtr++;
+		usiState = USI_SLAVE_REQUEST_REPLY_FROM_SEND_DATA;
+		SET_USI_TO_SEND_DATA();
+		break;
+
+	case USI_SLAVE_REQUEST_REPLY_FROM_SEND_DATA:
+		usiState = USI_SLAVE_CHECK_REPLY_FROM_SEND_DATA;
+		SET_USI_TO_READ_ACK();
+		break;
+
+	case USI_SLAVE_REQUEST_DATA:
+		usiState = USI_SLAVE_GET_DATA_AND_SEND_ACK;
+		SET_USI_TO_READ_DATA();
+		break;
+
+	case USI_SLAVE_GET_DATA_AND_SEND_ACK:
+		if (frameLen == BOOT_FRAME_MAX) {
+			// too long, NACK and drop it
+			frameLen = 0;
+			SET_USI_TO_TWI_START_CONDITION_MODE();
+			break;
+		}
+		frame[frameLen++] = USIDR;
+		usiState = USI_SLAVE_REQUEST_DATA;
+		SET_USI_TO_SEND_ACK();
+		break;
+	}
+}
+
+int main(void) {
+	uint8_t stay = GPIOR2 == BOOT_MAGIC;
+
+	// whatever the application left running stops, heaters off (PA5, PA7 high)
+	TIMSK0 = 0;
+	TIMSK1 = 0;
+	GIMSK = 0;
+	TCCR0A = 0;
+	TCCR0B = 0;
+	TCCR1A = 0;
+	TCCR1B = 0;
+	ADCSRA = 0;
+	PORTA |= (1 << PA5) | (1 << PA7);
+	DDRA |= (1 << PA5) | (1 << PA7);
+	PORTB &= ~(1 << PB2);
+	DDRB = 1 << PB2; // fan off, alert released
+	clock_prescale_set(clock_div_2);
+
+	stat[BOOT_STAT_STATE] = image_ok() ? BOOT_VALID : BOOT_IDLE;
+	if (stay) {
+		slaveAddress = GPIOR1;
+		eeprom_update_byte(BOOT_EE_ADDR, slaveAddress);
+	} else {
+		if (stat[BOOT_STAT_STATE] == BOOT_VALID)
+			app_start(); // keeps MCUSR for the application
+		slaveAddress = eeprom_read_byte(BOOT_EE_ADDR);
+		if (slaveAddress < 0x08 || slaveAddress > 0x77)
+			slaveAddress = BOOT_ADDRESS_DEFAULT;
+	}
+	MCUSR = 0;
+	wdt_disable();
+
+	PORT_USI |= (1 << PORT_USI_SCL) | (1 << PORT_USI_SDA);
+	DDR_USI |= (1 << PORT_USI_SCL);
+	DDR_USI &= ~(1 << PORT_USI_SDA);
+	SET_USI_TO_TWI_START_CONDITION_MODE();
+
+	for (;;)
+		usi_poll();
+}
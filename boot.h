@@ -0,0 +1,94 @@
+/*
+ * boot.h
+ *
+ * TWI bootloader, see boot.c. Flash layout, eeprom cells and bus protocol,
+ * shared by the bootloader, the application (REG_BOOT) and the host
+ * library (ofen_boot_*).
+ */
+
+#ifndef BOOT_H_
+#define BOOT_H_
+
+/* flash
+ * The application runs from 0 up to BOOT_START, the bootloader fills the
+ * rest. Its reset vector (word 0) always jumps to the bootloader, which
+ * starts the application through the vector of the image, kept in
+ * eeprom. The application must end below BOOT_START, app.ld fails its
+ * link otherwise. A bootloader past FLASHEND overflows the text region.
+ * ATtiny84: 6528 bytes for the application, 1664 for the bootloader. The
+ * rjmp at word 0 reaches BOOT_START by wrapping around the 8 KB flash.
+ */
+#define BOOT_PAGE_SIZE 64 // SPM_PAGESIZE
+#define BOOT_START     0x1980
+#define BOOT_APP_PAGES (BOOT_START / BOOT_PAGE_SIZE)
+#define BOOT_RJMP(from, to) (0xC000 | (((to) - (from) - 2) >> 1 & 0x0FFF)) // byte addresses
+
+/* eeprom, the top BOOT_EE_SIZE bytes belong to the bootloader. EEMEM
+ * variables of the application start at 0 and must stay below.
+ */
+#define BOOT_EE_SIZE   6
+#define BOOT_EE_VECT   ((uint16_t *) (E2END - 5))	// reset vector of the image (rjmp)
+#define BOOT_EE_CRC    ((uint16_t *) (E2END - 3))	// image crc
+#define BOOT_EE_PAGES  ((uint8_t *) (E2END - 1))	// image length, 0xFF: none or not checked
+#define BOOT_EE_ADDR   ((uint8_t *) E2END)			// slave address, 0xFF: BOOT_ADDRESS_DEFAULT
+#define BOOT_ADDRESS_DEFAULT 0x50
+
+/* start
+ * The application jumps to BOOT_START with interrupts off, BOOT_MAGIC in
+ * GPIOR2 and its slave address in GPIOR1, the bootloader then stays.
+ * After a reset it checks the image against BOOT_EE_CRC and starts it,
+ * or stays if there is none or it does not match.
+ */
+#define BOOT_MAGIC 0xB0
+#ifndef BOOT_ENTRY
+#define BOOT_ENTRY() ((void (*)(void)) (BOOT_START / 2))()
+#endif
+
+/* bus protocol
+ * The bootloader answers on its slave address and takes BOOT_CMD_PAGE
+ * frames by general call too, so one stream programs any number of
+ * ovens. Write frames: [command, arguments ...]
+ *  BOOT_CMD_PAGE     [page, 64 data bytes, crc lo | hi]
+ *                    erase and write one page, crc over page and data.
+ *                    A bad crc, a page at or above BOOT_APP_PAGES, a page
+ *                    0 that does not start with an rjmp or a page that
+ *                    does not read back right counts in BOOT_STAT_ERRORS.
+ *                    The stored image is not valid any more.
+ *  BOOT_CMD_PAGE_CRC [page]  crc of the page as stored (like the frame
+ *                    crc) to BOOT_STAT_CRC
+ *  BOOT_CMD_CHECK    [pages, crc lo | hi]  crc of the first pages to
+ *                    BOOT_STAT_CRC. If it matches the image is stored as
+ *                    valid: BOOT_VALID, else BOOT_BAD.
+ *  BOOT_CMD_RUN      [BOOT_MAGIC]  start the application if BOOT_VALID
+ * A frame of one byte sets the read pointer into the status block, reads
+ * continue from there (0xFF behind it), so a register read works.
+ * Frames are applied after the stop or repeated start that ends them.
+ * The chip halts while it writes flash and the USI holds SCL low from
+ * the next start condition on, wait BOOT_PAGE_MS after a page and
+ * BOOT_CHECK_MS after a check instead of relying on clock stretching.
+ * CRCs are CRC-CCITT (reflected, _crc_ccitt_update()) from 0xFFFF, the
+ * image crc runs over the data of whole pages, padded with 0xFF.
+ */
+#define BOOT_CMD_PAGE     0xB1
+#define BOOT_CMD_PAGE_CRC 0xB2
+#define BOOT_CMD_CHECK    0xB3
+#define BOOT_CMD_RUN      0xB4
+#define BOOT_FRAME_MAX    (2 + BOOT_PAGE_SIZE + 2)
+
+#define BOOT_PAGE_MS  12	// also after BOOT_CMD_PAGE_CRC
+#define BOOT_CHECK_MS 300	// whole application area
+#define BOOT_ENTER_MS 350	// REG_BOOT until it listens, it checks the image first
+
+// status block
+#define BOOT_STAT_ID     0 // BOOT_ID, REG_STATUS of the application never reads like this
+#define BOOT_STAT_STATE  1 // BOOT_IDLE, BOOT_VALID, BOOT_BAD
+#define BOOT_STAT_ERRORS 2 // rejected pages, wraps
+#define BOOT_STAT_CRC    3 // 16 bit
+#define BOOT_STAT_SIZE   5
+#define BOOT_ID          0xB0
+
+#define BOOT_IDLE  0 // no image or pages written since the last check
+#define BOOT_VALID 1
+#define BOOT_BAD   2
+
+#endif /* BOOT_H_ */
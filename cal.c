@@ -0,0 +1,57 @@
+/*
+ * cal.c
+ *
+ * Sensor linearisation. The table is generated at build time by
+ * tools/gen_caltable.py from the sensor type and gain, the trim lives
+ * in eeprom.
+ */
+
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include "cal.h"
+#include "caltable.h"
+
+#define CAL_MASK ((1 << CAL_SHIFT) - 1)
+
+static cal_trim_t eeTrim[2] EEMEM = { // CAL_EE_SIZE
+	{ 0, CAL_GAIN_ONE },
+	{ 0, CAL_GAIN_ONE },
+};
+
+// erased eeprom reads gain 0xFFFF, use no trim then
+void cal_load(uint8_t ch, cal_trim_t *trim) {
+	eeprom_read_block(trim, &eeTrim[ch], sizeof(cal_trim_t));
+	if (trim->gain == 0xFFFF) {
+		trim->offset = 0;
+		trim->gain = CAL_GAIN_ONE;
+	}
+}
+
+void cal_store(uint8_t ch, const cal_trim_t *trim) {
+	eeprom_update_block(trim, &eeTrim[ch], sizeof(cal_trim_t));
+}
+
+/*! \brief Raw value to 1/16 deg C.
+ * Linear interpolation between the table points, beyond the last point
+ * the result is clamped.
+ */
+int16_t cal_convert(uint16_t raw, const cal_trim_t *trim) {
+	uint8_t i = raw >> CAL_SHIFT;
+	int16_t y0, y1;
+	int32_t y;
+
+	y0 = pgm_read_word(&cal_table[i]);
+	if (i >= CAL_POINTS - 1)
+		y = y0;
+	else {
+		y1 = pgm_read_word(&cal_table[i + 1]);
+		y = y0 + (((int32_t) (y1 - y0) * (raw & CAL_MASK)) >> CAL_SHIFT);
+	}
+
+	y = ((y * trim->gain) >> 15) + trim->offset;
+	if (y > INT16_MAX)
+		return INT16_MAX;
+	if (y < INT16_MIN)
+		return INT16_MIN;
+	return y;
+}
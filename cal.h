@@ -0,0 +1,28 @@
+/*
+ * cal.h
+ *
+ * Sensor linearisation: raw value (REG_TEMP units) to temperature in
+ * 1/16 deg C via the piecewise linear table in caltable.h, then the
+ * per-unit trim y = y * gain / CAL_GAIN_ONE + offset.
+ */
+
+#ifndef CAL_H_
+#define CAL_H_
+
+#include <stdint.h>
+
+// trim gain is Q1.15: 0x8000 == 1.0
+#define CAL_GAIN_ONE 0x8000
+
+typedef struct {
+	int16_t offset;		// 1/16 deg C
+	uint16_t gain;		// CAL_GAIN_ONE == 1.0
+} cal_trim_t;
+
+#define CAL_EE_SIZE 8 // trim of both channels
+
+void cal_load(uint8_t ch, cal_trim_t *trim);
+void cal_store(uint8_t ch, const cal_trim_t *trim);
+int16_t cal_convert(uint16_t raw, const cal_trim_t *trim);
+
+#endif /* CAL_H_ */
@@ -0,0 +1,22 @@
+/*
+ * caltable.h
+ *
+ * Generated by tools/gen_caltable.py, do not edit.
+ * type K thermocouple, reference junction 25 deg C, gain 20, vref 1.1 V
+ */
+
+#ifndef CALTABLE_H_
+#define CALTABLE_H_
+
+#define CAL_SHIFT  9
+#define CAL_POINTS 33
+
+static const int16_t cal_table[CAL_POINTS] PROGMEM = {
+	400, 1069, 1732, 2408, 3094, 3779, 4453, 5117,
+	5774, 6427, 7076, 7723, 8368, 9013, 9659, 10308,
+	10960, 11617, 12280, 12949, 13625, 14308, 14997, 15695,
+	16401, 17116, 17841, 18577, 19326, 20090, 20869, 21667,
+	21953,
+};
+
+#endif /* CALTABLE_H_ */
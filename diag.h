@@ -0,0 +1,26 @@
+/*
+ * diag.h
+ *
+ * Optional isr instrumentation, see TWI_DIAG in USI_TWI_Slave.h.
+ * DIAG_ENTER() takes a Timer0 timestamp at the top of an isr body,
+ * DIAG_LEAVE(max) keeps the longest run in Timer0 ticks (8 cpu cycles).
+ * Prologue and epilogue are not included. Timer0 wraps every 2048
+ * cycles, longer isrs would not fit anyway.
+ */
+
+#ifndef DIAG_H_
+#define DIAG_H_
+
+// TWI_DIAG comes from USI_TWI_Slave.h, include that first
+
+#ifdef TWI_DIAG
+#define DIAG_ENTER()    uint8_t diag_t0 = TCNT0
+#define DIAG_LEAVE(max) do { uint8_t diag_d = TCNT0 - diag_t0; if (diag_d > (max)) (max) = diag_d; } while (0)
+#define DIAG_COUNT(cnt) ((cnt)++)
+#else
+#define DIAG_ENTER()
+#define DIAG_LEAVE(max)
+#define DIAG_COUNT(cnt)
+#endif
+
+#endif /* DIAG_H_ */
@@ -0,0 +1,63 @@
+/*
+ * bus_i2c.c
+ *
+ * ofen_bus_t on a Linux i2c-dev adapter, combined transfers with I2C_RDWR.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "ofen.h"
+
+typedef struct {
+	ofen_bus_t bus;
+	int fd;
+} bus_i2c_t;
+
+static int i2c_xfer(ofen_bus_t *bus, ofen_msg_t *msgs, int n) {
+	bus_i2c_t *b = (bus_i2c_t *) bus;
+	struct i2c_msg m[I2C_RDWR_IOCTL_MAX_MSGS];
+	struct i2c_rdwr_ioctl_data d = { m, n };
+	int i;
+
+	for (i = 0; i < n; i++) {
+		m[i].addr = msgs[i].addr;
+		m[i].flags = msgs[i].flags & OFEN_M_RD ? I2C_M_RD : 0;
+		m[i].len = msgs[i].len;
+		m[i].buf = msgs[i].buf;
+	}
+	// adapters report a NACK as ENXIO or EREMOTEIO, the caller only needs -EIO
+	return ioctl(b->fd, I2C_RDWR, &d) < 0 ? -EIO : n;
+}
+
+static void i2c_close(ofen_bus_t *bus) {
+	bus_i2c_t *b = (bus_i2c_t *) bus;
+
+	close(b->fd);
+	free(b);
+}
+
+static const ofen_bus_ops_t i2c_ops = { i2c_xfer, i2c_close };
+
+ofen_bus_t *ofen_bus_open_i2c(const char *dev) {
+	unsigned long funcs;
+	bus_i2c_t *b;
+	int fd;
+
+	if ((fd = open(dev, O_RDWR)) < 0)
+		return NULL;
+	if (ioctl(fd, I2C_FUNCS, &funcs) < 0 || !(funcs & I2C_FUNC_I2C)
+			|| !(b = calloc(1, sizeof(*b)))) {
+		close(fd);
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	b->bus.ops = &i2c_ops;
+	b->bus.max_msgs = I2C_RDWR_IOCTL_MAX_MSGS;
+	b->fd = fd;
+	return &b->bus;
+}
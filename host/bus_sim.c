@@ -0,0 +1,420 @@
+/*
+ * bus_sim.c
+ *
+ * Simulated bus, see ofen_sim.h. The slave side follows USI_TWI_Slave.c
+ * and the frame loop in main.c, keep them in step.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ofen_sim.h"
+
+#define SIM_AMBIENT   25.0	// deg C
+#define SIM_TAU_S     300.0	// heater time constant
+#define SIM_HEAT_DEGS 1.0	// deg C per second at full duty
+#define SIM_PROP      256	// duty per 1/16 deg C below the setpoint
+#define SIM_CATCH_UP  8		// samples run after a long pause, older ones are skipped
+#define SIM_HIST_DIV  12		// HIST_DIV in main.c
+#define SIM_RPM_DUTY  20	// fan rpm per duty step
+
+typedef struct {
+	uint8_t addr;
+	txbuffer_union_t reg;		// register file, little endian host
+	uint8_t snap[2 * TWI_SNAP_SIZE];
+	uint8_t pub;				// offset of the published snapshot
+	uint8_t fifo[TWI_FIFO_SIZE];
+	uint8_t tail, count;
+	uint8_t rxq[TWI_RX_QUEUE_SIZE];	// receive queue as in the driver
+	uint8_t rxhead, rxtail;		// free running
+	uint8_t rxlen, room, general, dropped;
+	uint8_t ptr, acked;
+	uint64_t rx_at;				// oldest queued frame complete, ns
+	uint64_t next_sample;		// ns
+	uint16_t seq;
+	uint8_t hist_div;
+	double t[2];				// plant, deg C
+} sim_oven_t;
+
+typedef struct {
+	ofen_bus_t bus;
+	ofen_sim_cfg_t cfg;
+	ofen_sim_stats_t st;
+	uint32_t rnd;
+	int n;
+	sim_oven_t oven[];
+} bus_sim_t;
+
+// writable registers as in main.c
+static const uint8_t reg_writable[TWI_TX_BUFFER_SIZE / 8] = {
+	0xC2, 0x3F, 0xFF, 0xFF, 0xFF, 0xF0, 0x1F, 0xCF, 0xFD, 0x03, 0x01,
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t sim_rand(bus_sim_t *b) {
+	b->rnd ^= b->rnd << 13;
+	b->rnd ^= b->rnd >> 17;
+	b->rnd ^= b->rnd << 5;
+	return b->rnd;
+}
+
+static void fifo_put(sim_oven_t *o, const uint8_t *d, uint8_t len) {
+	uint8_t i, drop;
+
+	if (o->count > TWI_FIFO_SIZE - len) {
+		drop = len + o->count % len; // and the rest of a partly read entry
+		o->tail = (o->tail + drop) % TWI_FIFO_SIZE;
+		o->count -= drop;
+	}
+	for (i = 0; i < len; i++)
+		o->fifo[(o->tail + o->count + i) % TWI_FIFO_SIZE] = d[i];
+	o->count += len;
+}
+
+static int16_t deg16(double t) {
+	return (int16_t) (t * 16.0);
+}
+
+// one published sample of channel seq & 1: plant, controller, snapshot, history
+static void sim_sample(bus_sim_t *b, sim_oven_t *o) {
+	double dt = 2 * b->cfg.sample_ms / 1000.0, k;
+	uint8_t *s = &o->snap[TWI_SNAP_SIZE - o->pub];
+	uint8_t hdr[3], e[HIST_ENTRY_SIZE];
+	uint8_t ch = o->seq & 1;
+	uint16_t sp = o->reg.w[(REG_SET_OH >> 1) + ch];
+	int32_t duty;
+
+	if (sp) {
+		duty = ((int32_t) sp - deg16(o->t[ch])) * SIM_PROP;
+		duty = duty < 0 ? 0 : duty > 0xFFFF ? 0xFFFF : duty;
+		o->reg.w[(REG_DUTY_OH >> 1) + ch] = duty;
+	}
+	k = (1.0 + o->reg.b[REG_FAN] / 255.0) / SIM_TAU_S;
+	o->t[ch] += dt * (SIM_HEAT_DEGS * o->reg.w[(REG_DUTY_OH >> 1) + ch] / 65535.0
+			- k * (o->t[ch] - SIM_AMBIENT));
+	o->reg.w[(REG_DEG_OH >> 1) + ch] = deg16(o->t[ch]);
+
+	// fan, an ideal one: speed control settles within a sample
+	if (o->reg.w[REG_RPM_SET >> 1])
+		o->reg.b[REG_FAN] = o->reg.w[REG_RPM_SET >> 1] / SIM_RPM_DUTY > 0xFF ? 0xFF
+				: o->reg.w[REG_RPM_SET >> 1] / SIM_RPM_DUTY;
+	o->reg.w[REG_RPM >> 1] = o->reg.b[REG_FAN] * SIM_RPM_DUTY;
+
+	if (!o->hist_div--) {
+		o->hist_div = SIM_HIST_DIV - 1;
+		e[0] = o->seq;
+		e[1] = o->seq >> 8;
+		e[2] = o->reg.b[REG_DEG_OH];
+		e[3] = o->reg.b[REG_DEG_OH + 1];
+		e[4] = o->reg.b[REG_DEG_UH];
+		e[5] = o->reg.b[REG_DEG_UH + 1];
+		fifo_put(o, e, HIST_ENTRY_SIZE);
+	}
+
+	s[SNAP_SEQ] = o->seq;
+	s[SNAP_STATUS] = o->reg.b[REG_STATUS];
+	memcpy(&s[SNAP_TEMP_OH], &o->reg.b[REG_DEG_OH], 4);
+	memcpy(&s[SNAP_DUTY_OH], &o->reg.b[REG_DUTY_OH], 4);
+	s[SNAP_FAN] = o->reg.b[REG_FAN];
+	hdr[0] = o->reg.b[REG_ADDRESS] << 1;
+	hdr[1] = REG_SNAP;
+	hdr[2] = hdr[0] | 1;
+	s[SNAP_PEC] = ofen_pec(ofen_pec(0, hdr, 3), s, SNAP_PEC);
+	o->pub = TWI_SNAP_SIZE - o->pub;
+	o->seq++;
+}
+
+// alert_update() in main.c, fresh: samples ran since the last call
+static void sim_alert(sim_oven_t *o, uint8_t fresh) {
+	uint8_t src = o->reg.b[REG_ALERT_SRC] & (1 << ALERT_READY);
+	int ch;
+
+	if (fresh)
+		src = 1 << ALERT_READY;
+	if (o->reg.b[REG_STATUS] & ((1 << REG_STATUS_FAULT) | (1 << REG_STATUS_STALL)))
+		src |= 1 << ALERT_FAULT;
+	for (ch = 0; ch < 2 && o->seq > 1; ch++) {
+		if ((int16_t) o->reg.w[(REG_DEG_OH >> 1) + ch] > (int16_t) o->reg.w[REG_ALERT_HI >> 1])
+			src |= 1 << ALERT_HIGH;
+		if ((int16_t) o->reg.w[(REG_DEG_OH >> 1) + ch] < (int16_t) o->reg.w[REG_ALERT_LO >> 1])
+			src |= 1 << ALERT_LOW;
+	}
+	o->reg.b[REG_ALERT_SRC] = src & o->reg.b[REG_ALERT];
+}
+
+// register side effects, the part of reg_write() a master can observe
+static void sim_reg_write(sim_oven_t *o, uint8_t reg) {
+	uint8_t ch;
+
+	switch (reg) {
+	case REG_FAN:
+		o->reg.w[REG_RPM_SET >> 1] = 0;
+		break;
+	case REG_SET_OH + 1:
+	case REG_SET_UH + 1:
+		ch = (reg - REG_SET_OH) >> 1;
+		o->reg.b[REG_PROF] = PROF_IDLE;
+		if (o->reg.w[reg >> 1])
+			o->reg.b[REG_STATUS] |= 1 << (REG_STATUS_PID_OH + ch);
+		else {
+			o->reg.b[REG_STATUS] &= ~(1 << (REG_STATUS_PID_OH + ch));
+			o->reg.w[(REG_DUTY_OH >> 1) + ch] = 0;
+		}
+		break;
+	case REG_DUTY_OH + 1:
+	case REG_DUTY_UH + 1:
+		ch = (reg - REG_DUTY_OH) >> 1;
+		o->reg.b[REG_PROF] = PROF_IDLE;
+		o->reg.w[(REG_SET_OH >> 1) + ch] = 0;
+		o->reg.b[REG_STATUS] &= ~(1 << (REG_STATUS_PID_OH + ch));
+		break;
+	case REG_ADDRESS:
+		if (o->reg.b[reg] < 0x08 || o->reg.b[reg] > 0x77)
+			o->reg.b[reg] = o->addr;
+		else
+			o->addr = o->reg.b[reg];
+		break;
+	case REG_PROF_DATA:
+		if (o->reg.b[REG_PROF_PTR] < PROF_IMAGE_SIZE)
+			o->reg.b[REG_PROF_PTR]++;
+		break;
+	case REG_PROF:
+		o->reg.b[REG_PROF] = PROF_IDLE;
+		break;
+	case REG_TUNE:
+		o->reg.b[REG_TUNE] = TUNE_IDLE;
+		break;
+	case REG_FAULT:
+	case REG_BOOT: // no bootloader here
+		o->reg.b[reg] = 0;
+		break;
+	}
+}
+
+static uint8_t sim_rx_byte(sim_oven_t *o, uint8_t i) {
+	return o->rxq[(o->rxtail + 1 + i) & TWI_RX_QUEUE_MASK];
+}
+
+// the frame loop of main(), oldest frame
+static void sim_frame(sim_oven_t *o) {
+	uint8_t hdr = o->rxq[o->rxtail & TWI_RX_QUEUE_MASK];
+	uint8_t i = 1, reg, len = hdr & 0x7F, general = hdr & 0x80;
+
+	if (general) {
+		if (sim_rx_byte(o, 0) != GROUP_ALL && !(sim_rx_byte(o, 0) & o->reg.b[REG_GROUP]))
+			len = 0;
+		i = 2;
+	}
+	reg = sim_rx_byte(o, i - 1);
+	for (; i < len; i++, reg++) {
+		reg &= TWI_TX_BUFFER_MASK;
+		if (!(reg_writable[reg >> 3] & (1 << (reg & 7))))
+			continue;
+		if (general && reg == REG_ADDRESS)
+			continue;
+		o->reg.b[reg] = sim_rx_byte(o, i);
+		sim_reg_write(o, reg);
+		if (reg == REG_PROF_DATA)
+			reg--;
+	}
+	o->rxtail += (hdr & 0x7F) + 1;
+}
+
+// run the chip up to now
+static void sim_advance(bus_sim_t *b, sim_oven_t *o, uint64_t now) {
+	uint64_t period = (uint64_t) b->cfg.sample_ms * 1000000;
+	int n = 0;
+
+	if (o->rxhead != o->rxtail && now >= o->rx_at + (uint64_t) b->cfg.proc_us * 1000)
+		while (o->rxhead != o->rxtail)
+			sim_frame(o);
+	while (o->next_sample <= now) {
+		if (++n > SIM_CATCH_UP)
+			o->next_sample = now - now % period + o->next_sample % period;
+		else
+			sim_sample(b, o);
+		o->next_sample += period;
+	}
+	o->reg.b[REG_HIST_COUNT] = o->count / HIST_ENTRY_SIZE;
+	o->reg.b[REG_RX_DROPPED] = o->dropped;
+	sim_alert(o, n > 0);
+}
+
+static uint8_t sim_read_byte(sim_oven_t *o, uint8_t snap) {
+	uint8_t v;
+
+	if (o->ptr == TWI_FIFO_PORT) {
+		if (!o->count)
+			return 0xFF;
+		v = o->fifo[o->tail];
+		o->tail = (o->tail + 1) % TWI_FIFO_SIZE;
+		o->count--;
+		return v;
+	}
+	if (o->ptr >= TWI_SNAP_BASE)
+		v = o->snap[snap + o->ptr - TWI_SNAP_BASE];
+	else if (o->ptr >= TWI_REG_FILE_SIZE)
+		v = 0xFF;
+	else
+		v = o->reg.b[o->ptr];
+	o->ptr = (o->ptr + 1) & TWI_TX_BUFFER_MASK;
+	return v;
+}
+
+// stop or repeated start, like Rx_Commit() in the driver
+static void sim_frame_end(bus_sim_t *b, uint64_t now) {
+	int i;
+
+	for (i = 0; i < b->n; i++) {
+		sim_oven_t *o = &b->oven[i];
+		if (o->rxlen > 1) {
+			if (o->rxhead == o->rxtail)
+				o->rx_at = now;
+			o->rxq[o->rxhead & TWI_RX_QUEUE_MASK] = o->rxlen | (o->general ? 0x80 : 0);
+			o->rxhead += o->rxlen + 1;
+			o->rxlen = 0;
+		}
+		o->acked = 0;
+	}
+}
+
+static int sim_xfer(ofen_bus_t *bus, ofen_msg_t *msgs, int n) {
+	bus_sim_t *b = (bus_sim_t *) bus;
+	uint64_t start = now_ns(), bits = 0, ns;
+	int i, j, k, acks, r = n;
+	uint8_t snap = 0;
+
+	b->st.xfers++;
+	for (i = 0; i < n && r == n; i++) {
+		ofen_msg_t *m = &msgs[i];
+		uint8_t general = !(m->flags & OFEN_M_RD) && m->addr == OFEN_GENERAL_CALL;
+
+		sim_frame_end(b, start);
+		bits += 1 + 9;
+		acks = 0;
+		for (k = 0; k < b->n; k++) {
+			sim_oven_t *o = &b->oven[k];
+			sim_advance(b, o, start);
+			if (o->addr != m->addr && !general)
+				continue;
+			if (!(m->flags & OFEN_M_RD)) {
+				o->rxlen = 0;
+				o->general = general;
+				o->room = TWI_RX_QUEUE_SIZE - 3 - (uint8_t) (o->rxhead - o->rxtail);
+				if ((int8_t) o->room < 1)
+					o->room = 1;
+			} else {
+				snap = o->pub;
+				o->reg.b[REG_ALERT_SRC] &= ~(1 << ALERT_READY); // any read
+			}
+			o->acked = 1;
+			acks++;
+		}
+		if (!acks) {
+			r = -EIO;
+			break;
+		}
+
+		for (j = 0; j < m->len; j++) {
+			bits += 9;
+			if (m->flags & OFEN_M_RD) {
+				for (k = 0; k < b->n && !b->oven[k].acked; k++)
+					;
+				m->buf[j] = sim_read_byte(&b->oven[k], snap);
+				if (b->cfg.err_ppm && sim_rand(b) % 1000000 < b->cfg.err_ppm)
+					m->buf[j] ^= 1 << (sim_rand(b) & 7);
+				continue;
+			}
+			for (k = 0, acks = 0; k < b->n; k++) {
+				sim_oven_t *o = &b->oven[k];
+				if (!o->acked)
+					continue;
+				if (o->rxlen == o->room) {
+					o->acked = 0; // NACK and wait for a start
+					if (o->rxlen < TWI_RX_BUFFER_SIZE)
+						o->dropped++; // queue full
+					o->rxlen = 0; // the frame is lost
+					continue;
+				}
+				if (!o->rxlen)
+					o->ptr = m->buf[j] & TWI_TX_BUFFER_MASK;
+				else
+					o->ptr = (o->ptr + 1) & TWI_TX_BUFFER_MASK;
+				o->rxq[(o->rxhead + 1 + o->rxlen++) & TWI_RX_QUEUE_MASK] = m->buf[j];
+				acks++;
+			}
+			if (!acks) {
+				r = -EIO;
+				break;
+			}
+		}
+		if (m->flags & OFEN_M_RD)
+			for (k = 0; k < b->n; k++)
+				b->oven[k].acked = 0;
+	}
+	bits++; // stop
+	sim_frame_end(b, start);
+
+	if (r < 0)
+		b->st.nacks++;
+	if (b->cfg.khz) {
+		ns = bits * 1000000 / b->cfg.khz;
+		b->st.busy_us += ns / 1000;
+		start += ns;
+		struct timespec ts = { start / 1000000000, start % 1000000000 };
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+	}
+	return r;
+}
+
+static void sim_close(ofen_bus_t *bus) {
+	free(bus);
+}
+
+static const ofen_bus_ops_t sim_ops = { sim_xfer, sim_close };
+
+void ofen_sim_defaults(ofen_sim_cfg_t *cfg) {
+	cfg->khz = OFEN_SIM_KHZ;
+	cfg->sample_ms = OFEN_SIM_SAMPLE_MS;
+	cfg->proc_us = OFEN_SIM_PROC_US;
+	cfg->err_ppm = 0;
+}
+
+/*! \brief Bus with n ovens at addr[].
+ * The ovens start cold with the pid off, their sample clocks are spread
+ * over one period. The first snapshot comes with the first sample, until
+ * then reads fail the PEC like on a freshly reset chip.
+ */
+ofen_bus_t *ofen_bus_open_sim(const ofen_sim_cfg_t *cfg, const uint8_t *addr, int n) {
+	uint64_t now = now_ns();
+	bus_sim_t *b;
+	int i;
+
+	if (n < 1 || !cfg->sample_ms || !(b = calloc(1, sizeof(*b) + n * sizeof(sim_oven_t))))
+		return NULL;
+	b->bus.ops = &sim_ops;
+	b->bus.max_msgs = 42; // like i2c-dev
+	b->cfg = *cfg;
+	b->rnd = 0x2545F491 ^ (uint32_t) now;
+	b->n = n;
+	for (i = 0; i < n; i++) {
+		sim_oven_t *o = &b->oven[i];
+		o->addr = addr[i];
+		o->reg.b[REG_ADDRESS] = addr[i];
+		o->t[0] = o->t[1] = SIM_AMBIENT;
+		o->next_sample = now + (sim_rand(b) % cfg->sample_ms + 1) * 1000000ULL;
+	}
+	return &b->bus;
+}
+
+void ofen_sim_stats(ofen_bus_t *bus, ofen_sim_stats_t *st) {
+	*st = ((bus_sim_t *) bus)->st;
+}
@@ -0,0 +1,445 @@
+/*
+ * ofen.c
+ *
+ * Register protocol on top of an ofen_bus_t, see ofen.h.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ofen.h"
+
+int ofen_xfer(ofen_bus_t *bus, ofen_msg_t *msgs, int n) {
+	if (n < 1 || n > bus->max_msgs)
+		return -EINVAL;
+	return bus->ops->xfer(bus, msgs, n);
+}
+
+void ofen_bus_close(ofen_bus_t *bus) {
+	if (bus)
+		bus->ops->close(bus);
+}
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*! \brief Send one write frame, retry while the slave NACKs.
+ * The slave ACKs its address but NACKs the first data byte while its
+ * receive queue is full, so a NACK is only an error after OFEN_BUSY_MS.
+ */
+static int write_frame(ofen_bus_t *bus, uint8_t addr, uint8_t *frame, uint8_t len) {
+	ofen_msg_t m = { addr, 0, len, frame };
+	uint64_t end = now_ms() + OFEN_BUSY_MS;
+	int r;
+
+	while ((r = ofen_xfer(bus, &m, 1)) == -EIO && now_ms() < end)
+		usleep(OFEN_RETRY_US);
+	return r < 0 ? r : 0;
+}
+
+int ofen_read(ofen_bus_t *bus, uint8_t addr, uint8_t reg, uint8_t *buf, uint16_t len) {
+	ofen_msg_t m[2] = {
+		{ addr, 0, 1, &reg },
+		{ addr, OFEN_M_RD, len, buf },
+	};
+
+	if (!len)
+		return -EINVAL;
+	return ofen_xfer(bus, m, 2) < 0 ? -EIO : len;
+}
+
+int ofen_write(ofen_bus_t *bus, uint8_t addr, uint8_t reg, const uint8_t *data, uint8_t len) {
+	uint8_t frame[TWI_RX_BUFFER_SIZE];
+
+	if (!len || len > OFEN_WRITE_MAX || addr == OFEN_GENERAL_CALL)
+		return -EINVAL;
+	frame[0] = reg;
+	memcpy(&frame[1], data, len);
+	return write_frame(bus, addr, frame, len + 1);
+}
+
+/*! \brief Group frame, applied by every oven with REG_GROUP & mask (all for GROUP_ALL).
+ * Nobody ACKs for sure on a shared address, so there is no busy retry.
+ */
+int ofen_write_group(ofen_bus_t *bus, uint8_t mask, uint8_t reg, const uint8_t *data,
+		uint8_t len) {
+	uint8_t frame[TWI_RX_BUFFER_SIZE];
+	ofen_msg_t m = { OFEN_GENERAL_CALL, 0, len + 2, frame };
+
+	if (!mask || !len || len > OFEN_WRITE_MAX - 1 || reg == REG_ADDRESS)
+		return -EINVAL;
+	frame[0] = mask;
+	frame[1] = reg;
+	memcpy(&frame[2], data, len);
+	return ofen_xfer(bus, &m, 1) < 0 ? -EIO : 0;
+}
+
+int ofen_read_word(ofen_bus_t *bus, uint8_t addr, uint8_t reg, uint16_t *val) {
+	uint8_t b[2];
+	int r = ofen_read(bus, addr, reg, b, 2);
+
+	if (r < 0)
+		return r;
+	*val = b[0] | b[1] << 8;
+	return 0;
+}
+
+// 16 bit registers take effect on the high byte, both go in one frame
+int ofen_write_word(ofen_bus_t *bus, uint8_t addr, uint8_t reg, uint16_t val) {
+	uint8_t b[2] = { val, val >> 8 };
+
+	return ofen_write(bus, addr, reg, b, 2);
+}
+
+// SMBus PEC, CRC-8 x^8 + x^2 + x + 1 like _crc8_ccitt_update()
+uint8_t ofen_pec(uint8_t crc, const uint8_t *data, uint16_t len) {
+	uint8_t i;
+
+	while (len--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++)
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+	return crc;
+}
+
+static uint8_t snap_reg = REG_SNAP;
+
+void ofen_snap_msgs(ofen_msg_t *m, uint8_t addr, uint8_t *raw) {
+	m[0] = (ofen_msg_t) { addr, 0, 1, &snap_reg };
+	m[1] = (ofen_msg_t) { addr, OFEN_M_RD, TWI_SNAP_SIZE, raw };
+}
+
+int ofen_snap_decode(uint8_t addr, const uint8_t *raw, ofen_snap_t *snap) {
+	uint8_t hdr[3] = { addr << 1, REG_SNAP, addr << 1 | 1 };
+	uint8_t i;
+
+	if (ofen_pec(ofen_pec(0, hdr, 3), raw, SNAP_PEC) != raw[SNAP_PEC])
+		return -EBADMSG;
+	snap->seq = raw[SNAP_SEQ];
+	snap->status = raw[SNAP_STATUS];
+	for (i = 0; i < 2; i++) {
+		snap->temp[i] = raw[SNAP_TEMP_OH + 2 * i] | raw[SNAP_TEMP_OH + 2 * i + 1] << 8;
+		snap->duty[i] = raw[SNAP_DUTY_OH + 2 * i] | raw[SNAP_DUTY_OH + 2 * i + 1] << 8;
+	}
+	snap->fan = raw[SNAP_FAN];
+	return 0;
+}
+
+int ofen_snapshot(ofen_bus_t *bus, uint8_t addr, ofen_snap_t *snap) {
+	uint8_t raw[TWI_SNAP_SIZE];
+	ofen_msg_t m[2];
+
+	ofen_snap_msgs(m, addr, raw);
+	if (ofen_xfer(bus, m, 2) < 0)
+		return -EIO;
+	return ofen_snap_decode(addr, raw, snap);
+}
+
+int ofen_set_setpoint(ofen_bus_t *bus, uint8_t addr, uint8_t ch, int16_t deg16) {
+	if (ch > 1 || deg16 < 0)
+		return -EINVAL;
+	return ofen_write_word(bus, addr, REG_SET_OH + 2 * ch, deg16);
+}
+
+int ofen_set_duty(ofen_bus_t *bus, uint8_t addr, uint8_t ch, uint16_t duty) {
+	if (ch > 1)
+		return -EINVAL;
+	return ofen_write_word(bus, addr, REG_DUTY_OH + 2 * ch, duty);
+}
+
+int ofen_set_fan(ofen_bus_t *bus, uint8_t addr, uint8_t duty) {
+	return ofen_write(bus, addr, REG_FAN, &duty, 1);
+}
+
+// speed control, 0 keeps the current duty open loop
+int ofen_set_fan_rpm(ofen_bus_t *bus, uint8_t addr, uint16_t rpm) {
+	return ofen_write_word(bus, addr, REG_RPM_SET, rpm);
+}
+
+int ofen_fan_rpm(ofen_bus_t *bus, uint8_t addr, uint16_t *rpm) {
+	return ofen_read_word(bus, addr, REG_RPM, rpm);
+}
+
+// kp, ki, kd, i_limit in one frame
+int ofen_set_pid(ofen_bus_t *bus, uint8_t addr, uint8_t ch, const int16_t param[4]) {
+	uint8_t b[8], i;
+
+	if (ch > 1)
+		return -EINVAL;
+	for (i = 0; i < 4; i++) {
+		b[2 * i] = param[i];
+		b[2 * i + 1] = (uint16_t) param[i] >> 8;
+	}
+	return ofen_write(bus, addr, REG_PID_OH + 8 * ch, b, 8);
+}
+
+// stored in eeprom, the oven answers on new_addr from the next transfer on
+int ofen_set_address(ofen_bus_t *bus, uint8_t addr, uint8_t new_addr) {
+	if (new_addr < 0x08 || new_addr > 0x77)
+		return -EINVAL;
+	return ofen_write(bus, addr, REG_ADDRESS, &new_addr, 1);
+}
+
+int ofen_rx_dropped(ofen_bus_t *bus, uint8_t addr) {
+	uint8_t n;
+	int r = ofen_read(bus, addr, REG_RX_DROPPED, &n, 1);
+
+	return r < 0 ? r : n;
+}
+
+int ofen_fault(ofen_bus_t *bus, uint8_t addr) {
+	uint8_t f;
+	int r = ofen_read(bus, addr, REG_FAULT, &f, 1);
+
+	return r < 0 ? r : f;
+}
+
+int ofen_fault_clear(ofen_bus_t *bus, uint8_t addr) {
+	uint8_t f = 0;
+
+	return ofen_write(bus, addr, REG_FAULT, &f, 1);
+}
+
+// the master has to write a frame at least this often while heating
+int ofen_set_timeout(ofen_bus_t *bus, uint8_t addr, uint8_t secs) {
+	return ofen_write(bus, addr, REG_TIMEOUT, &secs, 1);
+}
+
+// one frame, the read-only REG_ALERT_SRC in between is skipped by the oven
+int ofen_set_alert(ofen_bus_t *bus, uint8_t addr, uint8_t mask, int16_t hi, int16_t lo) {
+	uint8_t b[6] = { mask, 0, hi, (uint16_t) hi >> 8, lo, (uint16_t) lo >> 8 };
+
+	return ofen_write(bus, addr, REG_ALERT, b, 6);
+}
+
+int ofen_alert_src(ofen_bus_t *bus, uint8_t addr) {
+	uint8_t src;
+	int r = ofen_read(bus, addr, REG_ALERT_SRC, &src, 1);
+
+	return r < 0 ? r : src;
+}
+
+// switching point, duty and command in one frame, the command acts last
+int ofen_tune_start(ofen_bus_t *bus, uint8_t addr, uint8_t ch, int16_t deg16, uint8_t duty) {
+	uint8_t b[4] = { deg16, (uint16_t) deg16 >> 8, duty, TUNE_CMD_START | ch << TUNE_CH };
+
+	if (ch > 1 || !duty)
+		return -EINVAL;
+	return ofen_write(bus, addr, REG_TUNE_SET, b, 4);
+}
+
+int ofen_tune_state(ofen_bus_t *bus, uint8_t addr, uint16_t *tu, uint16_t *amp) {
+	uint8_t b[5];
+	int r = ofen_read(bus, addr, REG_TUNE, b, 5);
+
+	if (r < 0)
+		return r;
+	*tu = b[1] | b[2] << 8;
+	*amp = b[3] | b[4] << 8;
+	return b[0];
+}
+
+int ofen_hist_read(ofen_bus_t *bus, uint8_t addr, ofen_hist_t *h, int max) {
+	uint8_t raw[TWI_FIFO_SIZE], count;
+	int r, i;
+
+	if ((r = ofen_read(bus, addr, REG_HIST_COUNT, &count, 1)) < 0)
+		return r;
+	if (count > max)
+		count = max;
+	if (count > TWI_FIFO_SIZE / HIST_ENTRY_SIZE)
+		count = TWI_FIFO_SIZE / HIST_ENTRY_SIZE;
+	if (!count)
+		return 0;
+	// the port does not move the pointer, one burst drains the fifo
+	if ((r = ofen_read(bus, addr, REG_HIST_DATA, raw, count * HIST_ENTRY_SIZE)) < 0)
+		return r;
+	for (i = 0; i < count; i++) {
+		const uint8_t *e = &raw[i * HIST_ENTRY_SIZE];
+		h[i].seq = e[0] | e[1] << 8;
+		h[i].temp[0] = e[2] | e[3] << 8;
+		h[i].temp[1] = e[4] | e[5] << 8;
+	}
+	return count;
+}
+
+/*! \brief Write a profile image through the REG_PROF_DATA port.
+ * Every frame sets the pointer first, so a lost frame can't shift the
+ * image. The oven ignores the port while a profile runs.
+ */
+int ofen_prof_upload(ofen_bus_t *bus, uint8_t addr, const ofen_seg_t *seg, uint8_t n) {
+	uint8_t img[PROF_IMAGE_SIZE], b[OFEN_WRITE_MAX], state;
+	int r, off, len, i;
+
+	if (n > PROF_SEGS)
+		return -EINVAL;
+	if ((r = ofen_read(bus, addr, REG_PROF, &state, 1)) < 0)
+		return r;
+	state &= ~PROF_PAUSED;
+	if (state == PROF_RAMP || state == PROF_SOAK)
+		return -EBUSY;
+
+	img[0] = n;
+	for (i = 0; i < n; i++) {
+		uint8_t *s = &img[1 + i * PROF_SEG_SIZE];
+		s[PROF_SEG_TARGET] = seg[i].target;
+		s[PROF_SEG_TARGET + 1] = (uint16_t) seg[i].target >> 8;
+		s[PROF_SEG_RATE] = seg[i].rate;
+		s[PROF_SEG_RATE + 1] = seg[i].rate >> 8;
+		s[PROF_SEG_HOLD] = seg[i].hold;
+		s[PROF_SEG_HOLD + 1] = seg[i].hold >> 8;
+		s[PROF_SEG_FAN] = seg[i].fan;
+	}
+
+	for (off = 0; off < 1 + n * PROF_SEG_SIZE; off += len) {
+		len = 1 + n * PROF_SEG_SIZE - off;
+		if (len > OFEN_WRITE_MAX - 1)
+			len = OFEN_WRITE_MAX - 1;
+		b[0] = off;
+		memcpy(&b[1], &img[off], len);
+		if ((r = ofen_write(bus, addr, REG_PROF_PTR, b, len + 1)) < 0)
+			return r;
+	}
+	return 0;
+}
+
+int ofen_prof_cmd(ofen_bus_t *bus, uint8_t addr, uint8_t cmd) {
+	return ofen_write(bus, addr, REG_PROF, &cmd, 1);
+}
+
+// CRC-CCITT, reflected (0x8408) like _crc_ccitt_update()
+uint16_t ofen_crc_ccitt(uint16_t crc, const uint8_t *data, uint32_t len) {
+	uint8_t i;
+
+	while (len--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x8408 : crc >> 1;
+	}
+	return crc;
+}
+
+// the bootloader checks the image before it listens
+int ofen_boot_enter(ofen_bus_t *bus, uint8_t addr) {
+	uint8_t magic = BOOT_MAGIC;
+	int r = ofen_write(bus, addr, REG_BOOT, &magic, 1);
+
+	if (r < 0)
+		return r;
+	usleep(BOOT_ENTER_MS * 1000);
+	return 0;
+}
+
+// returns the rejected page count (wraps), -ENODEV if addr runs the application
+int ofen_boot_status(ofen_bus_t *bus, uint8_t addr, uint8_t *state, uint16_t *crc) {
+	uint8_t b[BOOT_STAT_SIZE];
+	int r = ofen_read(bus, addr, 0, b, sizeof(b));
+
+	if (r < 0)
+		return r;
+	if (b[BOOT_STAT_ID] != BOOT_ID)
+		return -ENODEV;
+	*state = b[BOOT_STAT_STATE];
+	*crc = b[BOOT_STAT_CRC] | b[BOOT_STAT_CRC + 1] << 8;
+	return b[BOOT_STAT_ERRORS];
+}
+
+static uint16_t boot_page_crc(uint8_t page, const uint8_t *data) {
+	return ofen_crc_ccitt(ofen_crc_ccitt(0xFFFF, &page, 1), data, BOOT_PAGE_SIZE);
+}
+
+/*! \brief One page, OFEN_GENERAL_CALL writes it into every bootloader.
+ * Waits until the chip is done with the flash.
+ */
+int ofen_boot_page(ofen_bus_t *bus, uint8_t addr, uint8_t page, const uint8_t *data) {
+	uint8_t f[BOOT_FRAME_MAX];
+	uint16_t crc = boot_page_crc(page, data);
+	ofen_msg_t m = { addr, 0, sizeof(f), f };
+	int r;
+
+	if (page >= BOOT_APP_PAGES)
+		return -EINVAL;
+	f[0] = BOOT_CMD_PAGE;
+	f[1] = page;
+	memcpy(&f[2], data, BOOT_PAGE_SIZE);
+	f[BOOT_FRAME_MAX - 2] = crc;
+	f[BOOT_FRAME_MAX - 1] = crc >> 8;
+	if (addr == OFEN_GENERAL_CALL)
+		r = ofen_xfer(bus, &m, 1) < 0 ? -EIO : 0;
+	else
+		r = write_frame(bus, addr, f, sizeof(f));
+	usleep(BOOT_PAGE_MS * 1000);
+	return r;
+}
+
+/*! \brief Check the image in one oven, mend it page by page.
+ */
+static int boot_check(ofen_bus_t *bus, uint8_t addr, const uint8_t *img, uint8_t pages,
+		uint16_t crc) {
+	uint8_t f[4] = { BOOT_CMD_CHECK, pages, crc, crc >> 8 }, state, p;
+	uint16_t got;
+	int r, t;
+
+	for (t = 0;; t++) {
+		if ((r = write_frame(bus, addr, f, sizeof(f))) < 0)
+			return r;
+		usleep(BOOT_CHECK_MS * 1000);
+		if ((r = ofen_boot_status(bus, addr, &state, &got)) < 0)
+			return r;
+		if (state == BOOT_VALID)
+			return 0;
+		if (t == OFEN_BOOT_TRIES)
+			return -EBADMSG;
+
+		for (p = 0; p < pages; p++) {
+			const uint8_t *data = &img[p * BOOT_PAGE_SIZE];
+			uint8_t q[2] = { BOOT_CMD_PAGE_CRC, p };
+
+			if ((r = write_frame(bus, addr, q, sizeof(q))) < 0)
+				return r;
+			usleep(BOOT_PAGE_MS * 1000);
+			if ((r = ofen_boot_status(bus, addr, &state, &got)) < 0)
+				return r;
+			if (got != boot_page_crc(p, data) && (r = ofen_boot_page(bus, addr, p, data)) < 0)
+				return r;
+		}
+	}
+}
+
+int ofen_boot_image(ofen_bus_t *bus, const uint8_t *addr, int n, const uint8_t *img,
+		uint32_t len, int *res) {
+	uint8_t buf[BOOT_START];
+	uint16_t crc;
+	int i, p, pages, ok = 0;
+
+	// word 0 is the reset vector, the bootloader takes an rjmp only
+	if (len < 2 || len > BOOT_START || (img[1] & 0xF0) != 0xC0)
+		return -EINVAL;
+	memset(buf, 0xFF, sizeof(buf));
+	memcpy(buf, img, len);
+	pages = (len + BOOT_PAGE_SIZE - 1) / BOOT_PAGE_SIZE;
+	crc = ofen_crc_ccitt(0xFFFF, buf, pages * BOOT_PAGE_SIZE);
+
+	// nobody ACKs for sure, the checks find what got lost
+	for (p = 0; p < pages; p++)
+		ofen_boot_page(bus, OFEN_GENERAL_CALL, p, &buf[p * BOOT_PAGE_SIZE]);
+
+	for (i = 0; i < n; i++) {
+		res[i] = boot_check(bus, addr[i], buf, pages, crc);
+		if (!res[i])
+			ok++;
+	}
+	return ok;
+}
+
+int ofen_boot_run(ofen_bus_t *bus, uint8_t addr) {
+	uint8_t f[2] = { BOOT_CMD_RUN, BOOT_MAGIC };
+
+	return write_frame(bus, addr, f, sizeof(f));
+}
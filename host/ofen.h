@@ -0,0 +1,156 @@
+/*
+ * ofen.h
+ *
+ * Host side master library for the oven controller (Linux).
+ * Talks the register protocol of registers.h: a write frame is
+ * [register pointer, data ...], a read sets the pointer with a write and
+ * reads back after a repeated start. All transfers go through an
+ * ofen_bus_t, either /dev/i2c-* (ofen_bus_open_i2c) or the simulated bus
+ * in ofen_sim.h. One bus must only be used by one thread at a time.
+ *
+ * Functions return 0 (or a byte count) on success and a negative errno
+ * on failure: -EIO NACK or bus error, -EBADMSG PEC or image mismatch,
+ * -EINVAL bad arguments, -ENODEV no bootloader at the address.
+ */
+
+#ifndef OFEN_H_
+#define OFEN_H_
+
+#include <stdint.h>
+#include "../USI_TWI_Slave.h"
+#include "../boot.h"
+#include "../registers.h"
+
+// one message of a combined transfer, like struct i2c_msg
+#define OFEN_M_RD 0x0001
+typedef struct {
+	uint8_t addr;
+	uint16_t flags;
+	uint16_t len;
+	uint8_t *buf;
+} ofen_msg_t;
+
+/* bus backend
+ * xfer runs the messages as one combined transfer (repeated starts, one
+ * stop at the end) and fails as a whole on the first NACK.
+ */
+typedef struct ofen_bus ofen_bus_t;
+typedef struct {
+	int (*xfer)(ofen_bus_t *bus, ofen_msg_t *msgs, int n);
+	void (*close)(ofen_bus_t *bus);
+} ofen_bus_ops_t;
+
+struct ofen_bus {
+	const ofen_bus_ops_t *ops;
+	int max_msgs; // per xfer call, I2C_RDWR_IOCTL_MAX_MSGS for i2c-dev
+};
+
+#define OFEN_GENERAL_CALL 0x00
+
+// data bytes per write frame, the pointer takes one byte of the slave's rx buffer
+#define OFEN_WRITE_MAX (TWI_RX_BUFFER_SIZE - 1)
+
+// NACKed writes are retried for OFEN_BUSY_MS, the slave NACKs while its
+// receive queue is full (eeprom registers take 3.4 ms per byte)
+#define OFEN_BUSY_MS  100
+#define OFEN_RETRY_US 500
+
+// snapshot window, decoded
+typedef struct {
+	uint8_t seq;		// sample counter, low byte
+	uint8_t status;		// REG_STATUS_* bits
+	int16_t temp[2];	// [0: oben, 1: unten] 1/16 deg C
+	uint16_t duty[2];	// as REG_DUTY_*
+	uint8_t fan;
+} ofen_snap_t;
+
+// history fifo entry
+typedef struct {
+	uint16_t seq;
+	int16_t temp[2];
+} ofen_hist_t;
+
+// profile segment, see registers.h
+typedef struct {
+	int16_t target;		// 1/16 deg C
+	uint16_t rate;		// 1/16 deg C per minute, 0 = jump
+	uint16_t hold;		// seconds
+	uint8_t fan;
+} ofen_seg_t;
+
+ofen_bus_t *ofen_bus_open_i2c(const char *dev);
+int ofen_xfer(ofen_bus_t *bus, ofen_msg_t *msgs, int n);
+void ofen_bus_close(ofen_bus_t *bus);
+
+// plain register access
+int ofen_read(ofen_bus_t *bus, uint8_t addr, uint8_t reg, uint8_t *buf, uint16_t len);
+int ofen_write(ofen_bus_t *bus, uint8_t addr, uint8_t reg, const uint8_t *data, uint8_t len);
+int ofen_write_group(ofen_bus_t *bus, uint8_t mask, uint8_t reg, const uint8_t *data, uint8_t len);
+int ofen_read_word(ofen_bus_t *bus, uint8_t addr, uint8_t reg, uint16_t *val);
+int ofen_write_word(ofen_bus_t *bus, uint8_t addr, uint8_t reg, uint16_t val);
+
+/* snapshot
+ * ofen_snap_msgs() fills two messages reading the snapshot of addr into
+ * raw[TWI_SNAP_SIZE], so that polls of many ovens can share one xfer.
+ * ofen_snap_decode() checks the PEC afterwards.
+ */
+uint8_t ofen_pec(uint8_t crc, const uint8_t *data, uint16_t len);
+void ofen_snap_msgs(ofen_msg_t *m, uint8_t addr, uint8_t *raw);
+int ofen_snap_decode(uint8_t addr, const uint8_t *raw, ofen_snap_t *snap);
+int ofen_snapshot(ofen_bus_t *bus, uint8_t addr, ofen_snap_t *snap);
+
+// control, ch 0: oben, 1: unten
+int ofen_set_setpoint(ofen_bus_t *bus, uint8_t addr, uint8_t ch, int16_t deg16);
+int ofen_set_duty(ofen_bus_t *bus, uint8_t addr, uint8_t ch, uint16_t duty);
+int ofen_set_fan(ofen_bus_t *bus, uint8_t addr, uint8_t duty);
+int ofen_set_fan_rpm(ofen_bus_t *bus, uint8_t addr, uint16_t rpm);
+int ofen_fan_rpm(ofen_bus_t *bus, uint8_t addr, uint16_t *rpm);
+int ofen_set_pid(ofen_bus_t *bus, uint8_t addr, uint8_t ch, const int16_t param[4]);
+int ofen_set_address(ofen_bus_t *bus, uint8_t addr, uint8_t new_addr);
+
+// write frames the slave dropped for a full receive queue, wraps at 256
+int ofen_rx_dropped(ofen_bus_t *bus, uint8_t addr);
+
+// safety layer: FAULT_* code (0 = none), clear, command timeout in seconds (0 = off)
+int ofen_fault(ofen_bus_t *bus, uint8_t addr);
+int ofen_fault_clear(ofen_bus_t *bus, uint8_t addr);
+int ofen_set_timeout(ofen_bus_t *bus, uint8_t addr, uint8_t secs);
+
+// alert line: ALERT_* enable mask, thresholds in REG_DEG units, pending ALERT_* conditions
+int ofen_set_alert(ofen_bus_t *bus, uint8_t addr, uint8_t mask, int16_t hi, int16_t lo);
+int ofen_alert_src(ofen_bus_t *bus, uint8_t addr);
+
+// auto-tune of channel ch around deg16 with the relay at duty << 8,
+// state returns TUNE_* | ch << TUNE_CH, mean period (samples) and amplitude
+int ofen_tune_start(ofen_bus_t *bus, uint8_t addr, uint8_t ch, int16_t deg16, uint8_t duty);
+int ofen_tune_state(ofen_bus_t *bus, uint8_t addr, uint16_t *tu, uint16_t *amp);
+
+// history fifo, returns the number of entries read
+int ofen_hist_read(ofen_bus_t *bus, uint8_t addr, ofen_hist_t *h, int max);
+
+// profile
+int ofen_prof_upload(ofen_bus_t *bus, uint8_t addr, const ofen_seg_t *seg, uint8_t n);
+int ofen_prof_cmd(ofen_bus_t *bus, uint8_t addr, uint8_t cmd);
+
+/* firmware update, see boot.h
+ * ofen_boot_enter() starts the bootloader of a running oven (a group:
+ * ofen_write_group() BOOT_MAGIC to REG_BOOT, then wait BOOT_ENTER_MS).
+ * ofen_boot_image() programs the image (a raw binary from address 0, at
+ * most BOOT_START bytes) into the n ovens in addr[] at once: every page
+ * goes out once by general call, then each oven checks its copy. One that
+ * does not match gets its bad pages again, addressed, up to
+ * OFEN_BOOT_TRIES times. res[i] is 0 for a valid image in addr[i] or a
+ * negative errno, the return value the number of valid ovens.
+ * ofen_boot_run() starts the checked application.
+ */
+#define OFEN_BOOT_TRIES 3
+
+uint16_t ofen_crc_ccitt(uint16_t crc, const uint8_t *data, uint32_t len);
+int ofen_boot_enter(ofen_bus_t *bus, uint8_t addr);
+int ofen_boot_status(ofen_bus_t *bus, uint8_t addr, uint8_t *state, uint16_t *crc);
+int ofen_boot_page(ofen_bus_t *bus, uint8_t addr, uint8_t page, const uint8_t *data);
+int ofen_boot_image(ofen_bus_t *bus, const uint8_t *addr, int n, const uint8_t *img,
+		uint32_t len, int *res);
+int ofen_boot_run(ofen_bus_t *bus, uint8_t addr);
+
+#endif /* OFEN_H_ */
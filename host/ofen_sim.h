@@ -0,0 +1,51 @@
+/*
+ * ofen_sim.h
+ *
+ * In-process bus with simulated ovens, a drop-in ofen_bus_t for testing
+ * masters without hardware. Each oven behaves like USI_TWI_Slave.c with
+ * the register file of main.c on top:
+ *  - register pointer auto-increment with wrap, 0xFF above the register
+ *    file, latched double buffered snapshot with PEC, history fifo port
+ *  - write frames of up to TWI_RX_BUFFER_SIZE bytes, longer ones NACKed
+ *    and dropped
+ *  - the receive queue of the driver: frames wait for the main loop
+ *    (proc_us after the first one ended), one that does not fit is
+ *    NACKed and counted in REG_RX_DROPPED
+ *  - group frames on the general call address
+ * The plant is a first order model per heater with a proportional
+ * stand-in for the chip's pid, profiles are stored but not run, auto-tune
+ * stays idle, REG_BOOT is ignored (no bootloader). Like the
+ * chip each sample is one channel, they alternate. REG_ALERT_SRC is
+ * computed, there is no line to watch.
+ * Bus time is real: xfer sleeps as long as the transfer takes at khz.
+ */
+
+#ifndef OFEN_SIM_H_
+#define OFEN_SIM_H_
+
+#include "ofen.h"
+
+typedef struct {
+	unsigned khz;		// bus clock, 0 = transfers take no time
+	unsigned sample_ms;	// publish period of the chip, one channel per sample
+	unsigned proc_us;	// main loop latency for a write frame
+	unsigned err_ppm;	// bit errors per million bytes read, shows up as PEC errors
+} ofen_sim_cfg_t;
+
+#define OFEN_SIM_KHZ       100
+#define OFEN_SIM_SAMPLE_MS 83 // (2 + 64) conversions at 800 Hz
+#define OFEN_SIM_PROC_US   200
+
+void ofen_sim_defaults(ofen_sim_cfg_t *cfg);
+ofen_bus_t *ofen_bus_open_sim(const ofen_sim_cfg_t *cfg, const uint8_t *addr, int n);
+
+// bus statistics: transfers, NACKs, bus time in us
+typedef struct {
+	uint64_t xfers;
+	uint64_t nacks;
+	uint64_t busy_us;
+} ofen_sim_stats_t;
+
+void ofen_sim_stats(ofen_bus_t *bus, ofen_sim_stats_t *st);
+
+#endif /* OFEN_SIM_H_ */
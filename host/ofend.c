@@ -0,0 +1,441 @@
+/*
+ * ofend.c
+ *
+ * Polling daemon: reads the snapshot of every oven once per interval and
+ * exports it through shared memory (ofend.h).
+ *
+ *   ofend [-i ms] [-n shm] [-t s] [-k khz] [-e ppm] [-v] BUS ...
+ *   ofend -r [-n shm]
+ *
+ * BUS is /dev/i2c-N:ADDR[,ADDR ...] or sim:COUNT for COUNT simulated
+ * ovens at 0x08 and up (-k bus clock, -e bit errors per million bytes).
+ * Every bus gets its own thread. Ovens are kept in a heap ordered by
+ * deadline, all that are due go out in one combined transfer. A NACK
+ * fails the whole transfer, then the batch is repeated oven by oven.
+ * -t stops after s seconds and prints throughput and poll latency,
+ * -v prints them every second, -r dumps the records of a running daemon.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "ofend.h"
+#include "ofen_sim.h"
+
+#define OFEND_INTERVAL_MS 200
+#define OFEND_BATCH       16	// ovens per combined transfer
+#define OFEND_SLACK_US    1000	// polls due this soon join the batch
+#define OFEND_FAILS       3		// failed polls before an oven is offline
+#define OFEND_OFFLINE_MS  1000
+#define OFEND_LAT_BUCKET  100	// latency histogram, us per bucket
+#define OFEND_LAT_BUCKETS 1000
+#define OFEND_SIM_BASE    0x08
+
+typedef struct {
+	uint8_t addr;
+	uint8_t fails;
+	uint64_t due;			// ns
+	ofend_rec_t *rec;
+} oven_t;
+
+typedef struct {
+	const char *spec;
+	ofen_bus_t *bus;
+	int sim;
+	int n;
+	oven_t *oven;
+	oven_t **heap;			// min-heap on due
+	pthread_t thread;
+	// statistics, read by the main thread without locking
+	volatile uint64_t polls, errors, xfers, late;
+	uint32_t lat[OFEND_LAT_BUCKETS];
+	uint32_t lat_max;
+	uint64_t busy_last;		// simulated bus time at the last report
+} bus_t;
+
+static volatile sig_atomic_t running = 1;
+static uint64_t interval;		// ns
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t) {
+	struct timespec ts = { t / 1000000000, t % 1000000000 };
+
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void on_signal(int sig) {
+	(void) sig;
+	running = 0;
+}
+
+static void heap_down(oven_t **h, int n, int i) {
+	oven_t *o = h[i];
+	int c;
+
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && h[c + 1]->due < h[c]->due)
+			c++;
+		if (o->due <= h[c]->due)
+			break;
+		h[i] = h[c];
+		i = c;
+	}
+	h[i] = o;
+}
+
+static void heap_up(oven_t **h, int i) {
+	oven_t *o = h[i];
+
+	while (i && h[(i - 1) / 2]->due > o->due) {
+		h[i] = h[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	h[i] = o;
+}
+
+static void rec_begin(ofend_rec_t *r) {
+	__atomic_store_n(&r->lock, r->lock + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void rec_end(ofend_rec_t *r) {
+	__atomic_store_n(&r->lock, r->lock + 1, __ATOMIC_RELEASE);
+}
+
+// result of one poll, then the next deadline
+static void poll_done(bus_t *b, oven_t *o, int ok, const ofen_snap_t *snap, uint64_t now) {
+	ofend_rec_t *r = o->rec;
+	uint64_t lat = now > o->due ? (now - o->due) / 1000 : 0;
+
+	rec_begin(r);
+	if (ok) {
+		r->snap = *snap;
+		r->flags = OFEND_REC_VALID;
+		r->time_ns = now;
+		r->polls++;
+		r->latency_us = lat;
+	} else {
+		r->errors++;
+		if (o->fails + 1 >= OFEND_FAILS)
+			r->flags |= OFEND_REC_OFFLINE;
+	}
+	rec_end(r);
+
+	if (ok) {
+		o->fails = 0;
+		b->polls++;
+		b->lat[lat / OFEND_LAT_BUCKET < OFEND_LAT_BUCKETS ? lat / OFEND_LAT_BUCKET
+				: OFEND_LAT_BUCKETS - 1]++;
+		if (lat > b->lat_max)
+			b->lat_max = lat;
+	} else {
+		b->errors++;
+		if (o->fails < OFEND_FAILS)
+			o->fails++;
+	}
+
+	if (o->fails >= OFEND_FAILS) {
+		o->due = now + OFEND_OFFLINE_MS * 1000000ULL;
+		return;
+	}
+	// fixed rate, missed slots are skipped
+	o->due += interval;
+	if (o->due <= now) {
+		b->late++;
+		o->due += (now - o->due) / interval * interval + interval;
+	}
+}
+
+static void *bus_thread(void *arg) {
+	bus_t *b = arg;
+	uint8_t raw[OFEND_BATCH][TWI_SNAP_SIZE];
+	ofen_msg_t m[2 * OFEND_BATCH];
+	oven_t *batch[OFEND_BATCH];
+	ofen_snap_t snap;
+	uint64_t now;
+	int ok[OFEND_BATCH], k, i, r, max;
+
+	max = b->bus->max_msgs / 2 < OFEND_BATCH ? b->bus->max_msgs / 2 : OFEND_BATCH;
+	while (running) {
+		now = now_ns();
+		if (b->heap[0]->due > now) {
+			sleep_until(b->heap[0]->due < now + 100000000 ? b->heap[0]->due : now + 100000000);
+			continue;
+		}
+
+		// take everything due, the heap shrinks while the batch is out
+		for (k = 0; k < max && k < b->n && b->heap[0]->due <= now + OFEND_SLACK_US * 1000; k++) {
+			batch[k] = b->heap[0];
+			b->heap[0] = b->heap[b->n - 1 - k];
+			heap_down(b->heap, b->n - 1 - k, 0);
+			ofen_snap_msgs(&m[2 * k], batch[k]->addr, raw[k]);
+		}
+
+		b->xfers++;
+		r = ofen_xfer(b->bus, m, 2 * k);
+		for (i = 0; i < k; i++)
+			ok[i] = r >= 0;
+		if (r < 0 && k > 1)
+			for (i = 0; i < k; i++) {
+				b->xfers++;
+				ok[i] = ofen_xfer(b->bus, &m[2 * i], 2) >= 0;
+			}
+
+		now = now_ns();
+		for (i = 0; i < k; i++) {
+			oven_t *o = batch[i];
+			ok[i] = ok[i] && ofen_snap_decode(o->addr, raw[i], &snap) == 0;
+			poll_done(b, o, ok[i], &snap, now);
+			b->heap[b->n - k + i] = o;
+			heap_up(b->heap, b->n - k + i);
+		}
+	}
+	return NULL;
+}
+
+static int parse_bus(bus_t *b, const char *spec, const ofen_sim_cfg_t *cfg) {
+	uint8_t addr[0x80];
+	char dev[256], *p, *e;
+	const char *c;
+	long v;
+	int n = 0;
+
+	b->spec = spec;
+	if (!strncmp(spec, "sim:", 4)) {
+		v = strtol(spec + 4, &e, 0);
+		if (*e || v < 1 || v > 0x78 - OFEND_SIM_BASE)
+			return -1;
+		for (n = 0; n < v; n++)
+			addr[n] = OFEND_SIM_BASE + n;
+		b->bus = ofen_bus_open_sim(cfg, addr, n);
+		b->sim = 1;
+	} else {
+		if (!(c = strrchr(spec, ':')) || c - spec >= (int) sizeof(dev))
+			return -1;
+		memcpy(dev, spec, c - spec);
+		dev[c - spec] = 0;
+		for (p = (char *) c + 1; *p && n < 0x80; p = *e ? e + 1 : e) {
+			v = strtol(p, &e, 0);
+			if (e == p || (*e && *e != ',') || v < 0x08 || v > 0x77)
+				return -1;
+			addr[n++] = v;
+		}
+		if (!n)
+			return -1;
+		if (!(b->bus = ofen_bus_open_i2c(dev)))
+			perror(dev);
+	}
+	if (!b->bus)
+		return -1;
+
+	b->n = n;
+	b->oven = calloc(n, sizeof(oven_t));
+	b->heap = calloc(n, sizeof(oven_t *));
+	if (!b->oven || !b->heap)
+		return -1;
+	for (n = 0; n < b->n; n++) {
+		b->oven[n].addr = addr[n];
+		b->heap[n] = &b->oven[n];
+	}
+	return 0;
+}
+
+static uint32_t lat_percentile(const uint32_t *h, uint64_t total, unsigned pct) {
+	uint64_t sum = 0, want = (total * pct + 99) / 100;
+	int i;
+
+	for (i = 0; i < OFEND_LAT_BUCKETS; i++)
+		if ((sum += h[i]) >= want && want)
+			return (i + 1) * OFEND_LAT_BUCKET;
+	return 0;
+}
+
+static void report(bus_t *bus, int nbus, double secs, uint64_t *last) {
+	ofen_sim_stats_t st;
+	uint64_t polls;
+	int i;
+
+	for (i = 0; i < nbus; i++) {
+		bus_t *b = &bus[i];
+		polls = b->polls;
+		printf("%-20s %4d ovens %8.1f polls/s %6llu err %6llu late  lat p50 %5u p99 %5u max %6u us",
+				b->spec, b->n, (polls - last[i]) / secs, (unsigned long long) b->errors,
+				(unsigned long long) b->late, lat_percentile(b->lat, polls, 50),
+				lat_percentile(b->lat, polls, 99), b->lat_max);
+		if (b->sim) {
+			ofen_sim_stats(b->bus, &st);
+			printf("  bus %3.0f%%", (st.busy_us - b->busy_last) / 10000.0 / secs);
+			b->busy_last = st.busy_us;
+		}
+		printf("\n");
+		last[i] = polls;
+	}
+	fflush(stdout);
+}
+
+static int dump(const char *name) {
+	ofend_shm_t *shm;
+	ofend_rec_t r;
+	uint64_t now = now_ns();
+	size_t size;
+	uint32_t i;
+	int fd;
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) < 0) {
+		perror(name);
+		return 1;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED || shm->magic != OFEND_MAGIC || shm->version != OFEND_VERSION) {
+		fprintf(stderr, "%s: no ofend data\n", name);
+		return 1;
+	}
+	size = sizeof(*shm) + shm->count * sizeof(ofend_rec_t);
+	munmap(shm, sizeof(*shm));
+	if ((shm = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror(name);
+		return 1;
+	}
+
+	printf("bus addr  seq status  oben   unten  duty oh duty uh fan    age ms  errors\n");
+	for (i = 0; i < shm->count; i++) {
+		ofend_rec_read(&shm->rec[i], &r);
+		printf("%3u 0x%02x", r.bus, r.addr);
+		if (r.flags & OFEND_REC_VALID)
+			printf("  %3u   0x%02x %6.1f %6.1f  0x%04x  0x%04x %3u %9llu", r.snap.seq,
+					r.snap.status, r.snap.temp[0] / 16.0, r.snap.temp[1] / 16.0,
+					r.snap.duty[0], r.snap.duty[1], r.snap.fan,
+					(unsigned long long) (now - r.time_ns) / 1000000);
+		else
+			printf("  %-66s", "-");
+		printf(" %7u%s\n", r.errors, r.flags & OFEND_REC_OFFLINE ? " offline" : "");
+	}
+	return 0;
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: ofend [-i ms] [-n shm] [-t s] [-k khz] [-e ppm] [-v] BUS ...\n"
+			"       ofend -r [-n shm]\n"
+			"BUS: /dev/i2c-N:ADDR[,ADDR ...] or sim:COUNT\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	const char *name = OFEND_SHM;
+	unsigned ms = OFEND_INTERVAL_MS, secs = 0, verbose = 0, rd = 0;
+	uint64_t t0, next, *last;
+	ofen_sim_cfg_t cfg;
+	ofend_shm_t *shm;
+	bus_t *bus;
+	size_t size;
+	int c, i, j, nbus, count = 0, fd;
+
+	ofen_sim_defaults(&cfg);
+	while ((c = getopt(argc, argv, "i:n:t:k:e:vr")) != -1)
+		switch (c) {
+		case 'i':
+			ms = atoi(optarg);
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		case 'k':
+			cfg.khz = atoi(optarg);
+			break;
+		case 'e':
+			cfg.err_ppm = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'r':
+			rd = 1;
+			break;
+		default:
+			usage();
+		}
+	if (rd)
+		return dump(name);
+	nbus = argc - optind;
+	if (!nbus || !ms || nbus > 0x100)
+		usage();
+
+	interval = ms * 1000000ULL;
+	bus = calloc(nbus, sizeof(bus_t));
+	last = calloc(nbus, sizeof(uint64_t));
+	for (i = 0; i < nbus; i++) {
+		if (parse_bus(&bus[i], argv[optind + i], &cfg) < 0) {
+			fprintf(stderr, "ofend: bad bus %s\n", argv[optind + i]);
+			return 1;
+		}
+		count += bus[i].n;
+	}
+
+	size = sizeof(*shm) + count * sizeof(ofend_rec_t);
+	if ((fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644)) < 0 || ftruncate(fd, size) < 0
+			|| (shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror(name);
+		return 1;
+	}
+	close(fd);
+	shm->version = OFEND_VERSION;
+	shm->count = count;
+	shm->interval_ms = ms;
+
+	// spread the first polls over one interval
+	t0 = now_ns();
+	for (i = 0, count = 0; i < nbus; i++)
+		for (j = 0; j < bus[i].n; j++, count++) {
+			oven_t *o = &bus[i].oven[j];
+			o->rec = &shm->rec[count];
+			o->rec->bus = i;
+			o->rec->addr = o->addr;
+			o->due = t0 + interval * j / bus[i].n;
+		}
+	__atomic_store_n(&shm->magic, OFEND_MAGIC, __ATOMIC_RELEASE);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	for (i = 0; i < nbus; i++)
+		if (pthread_create(&bus[i].thread, NULL, bus_thread, &bus[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+
+	for (next = t0 + 1000000000; running; next += 1000000000) {
+		sleep_until(next);
+		if (verbose)
+			report(bus, nbus, 1.0, last);
+		if (secs && next - t0 >= secs * 1000000000ULL)
+			running = 0;
+	}
+
+	for (i = 0; i < nbus; i++)
+		pthread_join(bus[i].thread, NULL);
+	if (secs) {
+		for (i = 0; i < nbus; i++)
+			last[i] = bus[i].busy_last = 0;
+		report(bus, nbus, (now_ns() - t0) / 1e9, last);
+	}
+	for (i = 0; i < nbus; i++)
+		ofen_bus_close(bus[i].bus);
+	munmap(shm, size);
+	shm_unlink(name);
+	return 0;
+}
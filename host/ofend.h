@@ -0,0 +1,58 @@
+/*
+ * ofend.h
+ *
+ * Shared memory export of the polling daemon. ofend creates the POSIX
+ * shm object OFEND_SHM (or the name given with -n) holding one record
+ * per oven, readers map it read-only and copy records with
+ * ofend_rec_read(). A record is guarded by a sequence counter that is
+ * odd while the daemon updates it.
+ */
+
+#ifndef OFEND_H_
+#define OFEND_H_
+
+#include <stdint.h>
+#include "ofen.h"
+
+#define OFEND_SHM     "/ofend"
+#define OFEND_MAGIC   0x4E45464F // "OFEN"
+#define OFEND_VERSION 1
+
+// ofend_rec_t.flags
+#define OFEND_REC_VALID   0x01 // snap holds a reading
+#define OFEND_REC_OFFLINE 0x02 // the last polls failed, retried every OFEND_OFFLINE_MS
+
+typedef struct {
+	uint32_t lock;			// odd while written
+	uint8_t bus;			// index in the command line
+	uint8_t addr;
+	uint8_t flags;			// OFEND_REC_*
+	uint8_t pad;
+	ofen_snap_t snap;
+	uint64_t time_ns;		// CLOCK_MONOTONIC of the last good poll
+	uint32_t polls;			// good polls
+	uint32_t errors;		// NACKs and PEC errors
+	uint32_t latency_us;	// last good poll, done minus due
+} ofend_rec_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;			// records
+	uint32_t interval_ms;	// poll interval per oven
+	ofend_rec_t rec[];
+} ofend_shm_t;
+
+// consistent copy of a record, spins while the daemon writes it
+static inline void ofend_rec_read(const ofend_rec_t *rec, ofend_rec_t *out) {
+	uint32_t s;
+
+	do {
+		while ((s = __atomic_load_n(&rec->lock, __ATOMIC_ACQUIRE)) & 1)
+			;
+		__builtin_memcpy(out, (const void *) rec, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&rec->lock, __ATOMIC_RELAXED) != s);
+}
+
+#endif /* OFEND_H_ */
@@ -0,0 +1,88 @@
+/*
+ * journal.c
+ *
+ * Record ring in eeprom, see journal.h.
+ */
+
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include "journal.h"
+
+#ifdef OFEN_JOURNAL
+#define REC_SEQ  JOURNAL_DATA
+#define REC_CRC  (JOURNAL_DATA + 1)
+#define REC_SIZE (JOURNAL_DATA + 2)
+#define POS_IDLE 0xFF
+
+// JOURNAL_EE_SIZE, erased like a fresh chip, so a flashed .eep holds no record
+static uint8_t eeJournal[JOURNAL_SLOTS][REC_SIZE] EEMEM = {
+	[0 ... JOURNAL_SLOTS - 1] = { [0 ... REC_SIZE - 1] = 0xFF }
+};
+static uint8_t jrnNewest = JOURNAL_SLOTS - 1;	// slot, the first record goes to 0
+static uint8_t jrnPos = POS_IDLE;				// next byte of the open record
+
+// over what is in the eeprom, so a record that did not make it fails
+static uint8_t slot_crc(uint8_t s) {
+	uint8_t i, crc = 0;
+
+	for (i = 0; i < REC_CRC; i++)
+		crc = _crc8_ccitt_update(crc, eeprom_read_byte(&eeJournal[s][i]));
+	return crc;
+}
+
+/*! \brief Find the newest valid record.
+ * Valid records carry consecutive seqs, compared modulo 256.
+ */
+uint8_t journal_init(void) {
+	uint8_t s, seq = 0, q, found = 0;
+
+	for (s = 0; s < JOURNAL_SLOTS; s++) {
+		if (slot_crc(s) != eeprom_read_byte(&eeJournal[s][REC_CRC]))
+			continue;
+		q = eeprom_read_byte(&eeJournal[s][REC_SEQ]);
+		if (!found || (int8_t) (q - seq) > 0) {
+			seq = q;
+			jrnNewest = s;
+			found = 1;
+		}
+	}
+	return found;
+}
+
+uint8_t journal_read(uint8_t i) {
+	return eeprom_read_byte(&eeJournal[jrnNewest][i]);
+}
+
+void journal_begin(void) {
+	jrnPos = 0;
+}
+
+uint8_t journal_busy(void) {
+	return jrnPos != POS_IDLE;
+}
+
+/*! \brief Write the next byte of the open record, if the eeprom is ready.
+ * The payload is taken byte by byte as the write goes on, so a record
+ * may mix values from up to REC_SIZE eeprom writes apart.
+ */
+void journal_poll(uint8_t (*data)(uint8_t i)) {
+	uint8_t s = jrnNewest + 1, b;
+
+	if (jrnPos == POS_IDLE || !eeprom_is_ready())
+		return;
+	if (s == JOURNAL_SLOTS)
+		s = 0;
+	if (jrnPos < REC_SEQ)
+		b = data(jrnPos);
+	else if (jrnPos == REC_SEQ)
+		b = eeprom_read_byte(&eeJournal[jrnNewest][REC_SEQ]) + 1;
+	else
+		b = slot_crc(s);
+	eeprom_update_byte(&eeJournal[s][jrnPos], b);
+	if (++jrnPos == REC_SIZE) {
+		jrnNewest = s;
+		jrnPos = POS_IDLE;
+	}
+}
+
+#endif /* OFEN_JOURNAL */
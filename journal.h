@@ -0,0 +1,36 @@
+/*
+ * journal.h
+ *
+ * Wear levelled ring of records in eeprom, for state that has to outlive
+ * a reset. JOURNAL_SLOTS slots of
+ *  [payload (JOURNAL_DATA bytes) | seq | crc]
+ * A new record goes into the slot after the newest one, one byte per
+ * journal_poll() while the eeprom is ready, in slot order. The crc
+ * (SMBus CRC-8 over payload and seq) comes last, so a record cut short
+ * by a reset does not count and the one before stays the newest; one cut
+ * before its seq is older than all others even if the crc happens to fit.
+ * Each slot takes every JOURNAL_SLOTS-th record, and eeprom_update_byte()
+ * leaves unchanged bytes alone.
+ */
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stdint.h>
+
+// 108 bytes, the settings take 139 more (main.c)
+#define JOURNAL_DATA  16
+#define JOURNAL_SLOTS 6
+#ifdef OFEN_JOURNAL
+#define JOURNAL_EE_SIZE (JOURNAL_SLOTS * (JOURNAL_DATA + 2))
+#else
+#define JOURNAL_EE_SIZE 0
+#endif
+
+uint8_t journal_init(void);			// finds the newest record, 0 if there is none
+uint8_t journal_read(uint8_t i);	// payload byte of the newest record
+void journal_begin(void);			// a new record, data() is asked for each byte
+uint8_t journal_busy(void);
+void journal_poll(uint8_t (*data)(uint8_t i));
+
+#endif /* JOURNAL_H_ */
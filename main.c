@@ -1,33 +1,199 @@
-// Chip type           : ATtiny44
+// Chip type           : ATtiny84
 // Clock frequency     : 1,638400 MHz
 
 
 #include <avr/io.h>
+#include <avr/eeprom.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <avr/power.h>
 #include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <util/crc16.h>
 #include "USI_TWI_Slave.h"
-
-// TWI transmission commands
-#define TWI_CMD_SET_OH_UH 0x00
-#define TWI_CMD_SET_OH    0x01
-#define TWI_CMD_SET_UH    0x02
-#define TWI_CMD_SET_FAN   0x03
+#include "boot.h"
+#include "cal.h"
+#include "diag.h"
+#include "journal.h"
+#include "pid.h"
+#include "registers.h"
 
 /*! Local variables */
-static rxbuffer_union_t TWI_RxBuf;
-static txbuffer_union_t TWI_TxBuf;
+static txbuffer_union_t TWI_TxBuf;	// register file, see registers.h
+
+/* filter config per channel, REG_FILTER_* with OFEN_FILTER, else ADC_FILTER_DEFAULT
+ *  [bit 4-6: iir shift, 0 = off | bit 2: median of 3 | bit 0-1: oversampling n, 4^n samples]
+ * Chain: median (per conversion) -> sum of 4^n -> first order iir y += (x - y) >> k.
+ */
+#define ADC_FILTER_OVS_MASK 0x03
+#define ADC_FILTER_MEDIAN   0x04
+#define ADC_FILTER_IIR_POS  4
+#define ADC_FILTER_IIR_MASK 0x70
+#define ADC_FILTER_DEFAULT  3 // 64 samples, no median, no iir
+#ifdef OFEN_FILTER
+static volatile uint8_t adcFilter[2] = { ADC_FILTER_DEFAULT, ADC_FILTER_DEFAULT };
+#define ADC_FILTER(ch) adcFilter[ch]
+#else
+#define ADC_FILTER(ch) ADC_FILTER_DEFAULT
+#endif
+
+// filter state, isr only, except adcIir[]: the filtered value (mean * 64)
+// per channel, main reads it with interrupts off once ADCCNT_NEW is set
+static uint16_t adcSum;
+static uint16_t adcMed[2];
+static uint16_t adcIir[2];
+
+// heater duty [0: oben, 1: unten], compare value << 4 | fraction, see heater_apply()
+static uint16_t heatDuty[2];	// requested
+static uint16_t heatOut[2];		// within the power budget
+#ifdef OFEN_DITHER
+static uint8_t heatErr[2];		// sigma-delta error
+#endif
+static uint8_t heatExcl;		// on-windows must not overlap
+#define PWM_PERIOD 0x1000 // ICR1 + 1
+#define DUTY_FRAC 4
 
-// adc values for top and lower temp sensors
-static uint16_t adcAccu[2];
+// last published temperatures (1/16 deg C), REG_DEG_*, and the heater controllers [0: oben, 1: unten]
+#define TEMP ((int16_t *) &TWI_TxBuf.w[REG_DEG_OH >> 1])
+static pid_ctrl_t pid[2];
+
+// every HIST_DIV'th published sample goes into the history fifo
+#ifndef HIST_DIV
+#define HIST_DIV 12
+#endif
+static uint16_t sampleSeq;
+static uint8_t histDiv;
 
 /* adc counter
- *  [bit 7: start shifting | bit 6: temp high or low? | bit 0-5: counter values]
+ *  [bit 6: temp high or low? | bit 4: conversion due | bit 0-1: new value per channel]
+ * Timer0 overflow paces the conversions (800 Hz), main starts each one by
+ * entering adc noise reduction sleep. Per channel the first ADC_SETTLE
+ * results after the mux switch are dropped, the next 4^n go through the
+ * filter chain. Main publishes each channel as soon as it is done.
  */
-#define ADCCNT_SHIFT 7
 #define ADCACCU_SEL 6
+#define ADCCNT_DUE 4
+#define ADCCNT_NEW 0
+#define ADC_SETTLE 2
 volatile uint8_t adcCnt;
+static uint8_t adcSample; // conversions since the last mux switch, isr only
+
+// slave address and group mask, erased eeprom falls back to the defaults
+#define TWI_ADDRESS_DEFAULT 0x50
+static uint8_t eeAddress EEMEM = TWI_ADDRESS_DEFAULT;
+static uint8_t eeGroup EEMEM = 0x00;
+static uint8_t twiAddress;	// the one in use, an erased or invalid eeAddress is not
+
+// ramp/soak profile, see registers.h. Segment and progress live in the register file.
+#ifdef OFEN_PROFILE
+static uint8_t eeProf[PROF_IMAGE_SIZE] EEMEM;
+#endif
+// REG_PID_* order, erased keeps the default, so does a flashed .eep
+static int16_t eePid[2][4] EEMEM = { { -1, -1, -1, -1 }, { -1, -1, -1, -1 } };
+
+// EEMEM of the application from 0 up, eeTrim and the journal included
+#if 1 + 1 + PROF_IMAGE_SIZE + 2 * 4 * 2 + CAL_EE_SIZE + JOURNAL_EE_SIZE > E2END + 1 - BOOT_EE_SIZE
+#error application eeprom runs into the bootloader cells
+#endif
+static uint8_t profState;		// stays 0 without OFEN_PROFILE
+#ifdef OFEN_PROFILE
+static uint8_t profRem;			// ramp remainder, REG_DEG units / 60
+#define PROF_SEG(n) (1 + (n) * PROF_SEG_SIZE)
+#endif
+
+/* scheduler clock, ticks of T0_CYCLES cpu cycles at clock_div_2 (1.25 ms)
+ * Timer0 overflows every 8 * 256 cycles, but clkI/O stands still during
+ * each noise reduction conversion (13.5 adc clocks at clk/32), main adds
+ * those cycles back.
+ */
+#define CPU_HZ 1638400UL
+#define T0_CYCLES 2048
+#define NR_CYCLES 432
+#define SCHED_HZ (CPU_HZ / T0_CYCLES)
+static volatile uint8_t t0Ticks;	// timer0 overflows, free running
+static uint8_t schedT0;			// t0Ticks counted so far
+static uint16_t schedFrac;		// conversion cycles not counted yet
+static uint16_t schedNow;		// ticks, wraps
+
+/* periodic tasks, see REG_TASK_OVERRUN
+ * Table order is the priority, due tasks run first to last. A task is
+ * released every period ticks and should start within deadline ticks,
+ * a later start counts as an overrun. One that fell behind runs again on
+ * the next passes until it caught up, so no second gets lost. Event work
+ * (write frames, samples, the timer1 period) runs on every pass of the
+ * main loop, before the tasks.
+ */
+#define TASK_SAFE 0
+#define TASK_FAN  1
+#define TASK_PROF 2
+#define TASKS     3
+typedef struct {
+	uint16_t period;	// ticks
+	uint8_t deadline;	// ticks after the release
+} task_t;
+static const task_t tasks[TASKS] PROGMEM = {
+	{ SCHED_HZ, SCHED_HZ / 10 },	// TASK_SAFE: safe_second()
+	{ SCHED_HZ, SCHED_HZ / 10 },	// TASK_FAN: fan_second(), the tach window
+	{ SCHED_HZ, SCHED_HZ / 10 },	// TASK_PROF: prof_second(), jrn_second()
+};
+static uint16_t taskNext[TASKS];	// next release in schedNow ticks
+
+#ifdef TWI_DIAG
+static uint8_t diagMaxT0, diagMaxAdc; // isr run time maxima, see diag.h
+static uint8_t diagMaxTask;			// longest periodic task, same unit
+#endif
+
+// system clock while there is nothing to do, see the power manager in main()
+#define CLOCK_STANDBY clock_div_16
+
+/* safety layer, see REG_FAULT
+ * The adc isr trips on an open sensor within SAFE_OPEN_N conversions,
+ * main checks every sample and once per second. If main stalls for
+ * SAFE_WDT the watchdog interrupt cuts the heaters, the next timeout
+ * resets the chip.
+ */
+#define SAFE_ADC_OPEN   1020		// raw conversion, the pull-up drives an open input to the rail
+#define SAFE_OPEN_N     8			// consecutive conversions, 10 ms
+#define SAFE_TEMP_MAX   (350 * 16)
+#define SAFE_JUMP       (10 * 16)	// per sample
+#define SAFE_STUCK_DUTY 0x8000		// heating with at least half power ...
+#define SAFE_STUCK_S    60			// ... for this many seconds ...
+#define SAFE_STUCK_RISE 2			// ... must raise the temperature by 2 * 2 deg C
+#define SAFE_WDT        WDTO_120MS
+#define FAULT (*(volatile uint8_t *) &TWI_TxBuf.b[REG_FAULT])
+static uint8_t safeOpen;		// conversions at the rail, isr only
+static uint8_t safeIdle;		// seconds heating since a frame last wrote a register
+static uint8_t safeWin;			// second in the stuck window
+static uint8_t safeHot;			// bit per channel: hot all window long
+static uint8_t safeRef[2];		// temperature >> 5 at the start of the window
+
+/* fan speed, see REG_RPM
+ * PCINT9 counts the falling tach edges, main reads and clears the count
+ * once per second.
+ */
+#define FAN_PPR       2			// tach pulses per turn
+#define FAN_DUTY_MIN  40		// lowest duty the fan starts with
+#define FAN_RPM_STEP  16		// rpm error per duty step ...
+#define FAN_STEP_MAX  16		// ... up to this many steps per second
+static volatile uint8_t fanTach;	// pulses this second, sticks at 255
+static uint8_t fanWin;			// fan was driven at the start of the second
+
+/* auto-tune, see REG_TUNE
+ * Period and amplitude add up in REG_TUNE_TU and REG_TUNE_AMP. Gains
+ * after Tyreus-Luyben, kp = Ku / 3.2 and Ti = 2.2 Tu, with the relay
+ * estimate Ku = 4 d / (pi a). In pid units (Q8.8 compare counts per
+ * REG_DEG unit) d = duty << 3 and a = amp / 2, so kp = TUNE_KP * duty / amp.
+ */
+#define TUNE_HYST     8			// REG_DEG units, 0.5 deg C
+#define TUNE_CYCLES   4			// measured, after the first one
+#define TUNE_KP       1630		// 256 * 64 / (3.2 * pi)
+#define TUNE_ON       0x80		// tuneCycle: relay on
+#define TUNE_DUTY_DEFAULT 0x80
+static uint8_t tuneState;		// TUNE_* | ch << TUNE_CH, stays 0 without OFEN_TUNE
+#ifdef OFEN_TUNE
+static uint8_t tuneCycle;		// switch-ons so far | TUNE_ON
+static int16_t tuneMax, tuneMin;	// extremes in the current cycle
+#endif
 
 /* \Brief The main function.
  * The program entry point. Initiates TWI and enters eternal loop, waiting for data.
@@ -36,14 +202,1011 @@ int main(void)
 /* should be void and noreturn ... */
 __attribute__((naked));
 
+#ifdef OFEN_DITHER
+/*! \brief Compare value of heater ch, dithered with the fraction of heatOut[].
+ * The error only moves on with tick set.
+ */
+static uint16_t pwm_compare(uint8_t ch, uint8_t cfg, uint8_t tick) {
+	uint16_t c = heatOut[ch] >> DUTY_FRAC;
+	uint8_t e;
+
+	if (cfg & (1 << REG_POWER_DITHER)) {
+		e = heatErr[ch] + (heatOut[ch] & ((1 << DUTY_FRAC) - 1));
+		if (e >= (1 << DUTY_FRAC)) {
+			e -= 1 << DUTY_FRAC;
+			if (c < PWM_PERIOD - 1)
+				c++;
+		}
+		if (tick)
+			heatErr[ch] = e;
+	}
+	return c;
+}
+#else
+#define pwm_compare(ch, cfg, tick) ((void) (tick), heatOut[ch] >> DUTY_FRAC)
+#endif
+
+/*! \brief Timer1 outputs from heatOut[].
+ * obere hitze: OC1B hardware pwm, on in [0, OCR1B).
+ * untere hitze: software pwm on PA7, on from timer1 overflow (or compare B
+ * when staggered) until compare A. Both compare registers are double
+ * buffered, so the new window starts with the next period.
+ * Called on every change and with tick set once per period, only then
+ * the dither error moves on.
+ */
+static void pwm_update(uint8_t tick) {
+	uint8_t cfg = TWI_TxBuf.b[REG_POWER];
+	uint16_t c[2], end;
+	uint8_t mask;
+
+	c[0] = pwm_compare(0, cfg, tick);
+	c[1] = pwm_compare(1, cfg, tick);
+
+	// an isr may have tripped since heater_apply()
+	cli();
+	if (FAULT)
+		c[0] = c[1] = 0;
+	OCR1B = c[0];
+	if (c[0])
+		TCCR1A = 0x32;
+	else
+		TCCR1A = 0x02;
+
+	if (!c[1]) {
+		OCR1A = 0;
+		mask = 1 << OCIE1A;
+		PORTA |= (1 << PA7);
+	} else if (heatExcl || (cfg & (1 << REG_POWER_STAGGER))) {
+		end = c[0] + c[1];
+		if (heatExcl && end > PWM_PERIOD)
+			end = PWM_PERIOD; // dither carries must not overlap either
+		OCR1A = end & (PWM_PERIOD - 1); // may wrap into the next period
+		mask = (1 << OCIE1B) | (1 << OCIE1A);
+	} else {
+		OCR1A = c[1];
+		mask = (1 << TOIE1) | (1 << OCIE1A);
+	}
+	if (TIMSK1 != mask) { // stale flags only for newly enabled edges
+		TIFR1 = mask & ~TIMSK1;
+		TIMSK1 = mask;
+	}
+	sei();
+}
+
+/*! \brief heatOut[] from heatDuty[] and the power budget.
+ * Over budget the heaters take turns, and the mean power
+ * rating * duty of both together stays within REG_PEAK, so a single
+ * heater rated above it is held down on its own. Only with OFEN_PEAK.
+ */
+static void heater_apply(void) {
+	uint16_t oh = heatDuty[0], uh = heatDuty[1];
+#ifdef OFEN_PEAK
+	uint8_t peak = TWI_TxBuf.b[REG_PEAK];
+	uint8_t roh = TWI_TxBuf.b[REG_RATING_OH], ruh = TWI_TxBuf.b[REG_RATING_UH];
+	uint32_t sum;
+#endif
+
+	if (FAULT)
+		oh = uh = 0;
+#ifdef OFEN_PEAK
+	sum = (uint32_t) oh + uh;
+	TWI_TxBuf.b[REG_STATUS] &= ~(1 << REG_STATUS_LIMIT);
+	heatExcl = peak && roh + ruh > peak;
+	if (heatExcl && sum > 0xFFFF) {
+		// only one heater at a time, both share one period
+		oh = ((uint32_t) oh << 16) / sum;
+		uh = -oh; // 0x10000 - oh
+		TWI_TxBuf.b[REG_STATUS] |= 1 << REG_STATUS_LIMIT;
+	}
+	if (heatExcl) {
+		// mean power in rating * 1/256 units, scaled down to peak << 8
+		sum = ((uint32_t) roh * oh + (uint32_t) ruh * uh) >> 8;
+		if (sum > (uint32_t) peak << 8) {
+			sum++; // errs on the low side
+			oh = ((uint32_t) oh * peak << 8) / sum;
+			uh = ((uint32_t) uh * peak << 8) / sum;
+			TWI_TxBuf.b[REG_STATUS] |= 1 << REG_STATUS_LIMIT;
+		}
+	}
+#endif
+
+	heatOut[0] = oh;
+	heatOut[1] = uh;
+	TWI_TxBuf.w[REG_DUTY_OH >> 1] = oh;
+	TWI_TxBuf.w[REG_DUTY_UH >> 1] = uh;
+	pwm_update(0);
+}
+
+static void hist_log(void) {
+	uint8_t entry[HIST_ENTRY_SIZE];
+
+	entry[0] = sampleSeq;
+	entry[1] = sampleSeq >> 8;
+	entry[2] = TEMP[0];
+	entry[3] = TEMP[0] >> 8;
+	entry[4] = TEMP[1];
+	entry[5] = TEMP[1] >> 8;
+	USI_TWI_FIFO_Put(entry, HIST_ENTRY_SIZE);
+}
+
+/*! \brief Publish the snapshot of the current sample.
+ * Skipped if the master is still reading the spare buffer, the next
+ * sample comes soon enough.
+ */
+static void snap_publish(void) {
+	uint8_t *s = USI_TWI_Snapshot_Buffer();
+	uint8_t i, crc, addr = TWI_TxBuf.b[REG_ADDRESS] << 1;
+
+	if (!s)
+		return;
+	s[SNAP_SEQ] = sampleSeq;
+	s[SNAP_STATUS] = TWI_TxBuf.b[REG_STATUS];
+	for (i = 0; i < 2; i++) {
+		s[SNAP_TEMP_OH + 2 * i] = TEMP[i];
+		s[SNAP_TEMP_OH + 2 * i + 1] = TEMP[i] >> 8;
+		s[SNAP_DUTY_OH + 2 * i] = heatOut[i];
+		s[SNAP_DUTY_OH + 2 * i + 1] = heatOut[i] >> 8;
+	}
+	s[SNAP_FAN] = TWI_TxBuf.b[REG_FAN];
+
+	// smbus pec as seen by the master
+	crc = _crc8_ccitt_update(0, addr);
+	crc = _crc8_ccitt_update(crc, REG_SNAP);
+	crc = _crc8_ccitt_update(crc, addr | 1);
+	for (i = 0; i < SNAP_PEC; i++)
+		crc = _crc8_ccitt_update(crc, s[i]);
+	s[SNAP_PEC] = crc;
+
+	USI_TWI_Snapshot_Publish();
+}
+
+#ifdef OFEN_ALERT
+/*! \brief Alert line from the REG_ALERT conditions, once per loop.
+ * fresh: a sample was published since the last call.
+ */
+static void alert_update(uint8_t fresh) {
+	uint8_t src = TWI_TxBuf.b[REG_ALERT_SRC] & (1 << ALERT_READY);
+	uint8_t i;
+
+	if (USI_TWI_Read_Seen())
+		src = 0;
+	if (fresh)
+		src = 1 << ALERT_READY;
+	if (TWI_TxBuf.b[REG_STATUS] & ((1 << REG_STATUS_FAULT) | (1 << REG_STATUS_STALL)))
+		src |= 1 << ALERT_FAULT;
+	for (i = 0; i < 2 && sampleSeq > 1; i++) {
+		if (TEMP[i] > (int16_t) TWI_TxBuf.w[REG_ALERT_HI >> 1])
+			src |= 1 << ALERT_HIGH;
+		if (TEMP[i] < (int16_t) TWI_TxBuf.w[REG_ALERT_LO >> 1])
+			src |= 1 << ALERT_LOW;
+	}
+	src &= TWI_TxBuf.b[REG_ALERT];
+	TWI_TxBuf.b[REG_ALERT_SRC] = src;
+
+	// open drain, PORTB0 stays 0
+	if (src)
+		DDRB |= 1 << PB0;
+	else
+		DDRB &= ~(1 << PB0);
+}
+#else
+#define alert_update(fresh) ((void) (fresh))
+#endif
+
+static void set_fan(uint8_t duty) {
+	OCR0A = duty;
+	if (duty)
+		TCCR0A = 0x83;
+	else
+		TCCR0A = 0x03;
+}
+
+// ch 0: obere, 1: untere hitze
+static void set_heater(uint8_t ch, uint16_t duty) {
+	heatDuty[ch] = duty;
+	heater_apply();
+}
+
+// controller input, the pid works on unsigned values
+static uint16_t temp_meas(uint8_t ch) {
+	return TEMP[ch] > 0 ? TEMP[ch] : 0;
+}
+
+static void trim_get(uint8_t ch, cal_trim_t *trim) {
+	trim->offset = TWI_TxBuf.w[(REG_TRIM_OH >> 1) + 2 * ch];
+	trim->gain = TWI_TxBuf.w[(REG_TRIM_OH >> 1) + 2 * ch + 1];
+}
+
+static void set_control(uint8_t ch, uint16_t setpoint) {
+	if (FAULT)
+		setpoint = 0;
+	TWI_TxBuf.w[(REG_SET_OH >> 1) + ch] = setpoint;
+	pid_set_setpoint(&pid[ch], setpoint, temp_meas(ch));
+	if (setpoint)
+		TWI_TxBuf.b[REG_STATUS] |= 1 << (REG_STATUS_PID_OH + ch);
+	else {
+		TWI_TxBuf.b[REG_STATUS] &= ~(1 << (REG_STATUS_PID_OH + ch));
+		set_heater(ch, 0);
+	}
+}
+
+static uint8_t tune_running(void) {
+	return (tuneState & 0x0F) == TUNE_RUN;
+}
+
+// a tune run counts in its relay-off half too, see the power manager
+static uint8_t heating(void) {
+	return pid[0].setpoint || pid[1].setpoint || heatDuty[0] || heatDuty[1] || tune_running();
+}
+
+/*! \brief Heaters off right away and latch the fault code.
+ * Also called from isrs, main clears the control state afterwards.
+ */
+static void safe_trip(uint8_t code) {
+	TCCR1A = 0x02; // OC1B disconnected, the port holds it high
+	TIMSK1 = 0; // no more PA7 edges
+	PORTA |= (1 << PA7);
+	if (!FAULT)
+		FAULT = code;
+}
+
+// per sample, before TEMP[] is updated. Channels alternate, so samples 0 and 1 are the first ones.
+static void safe_sample(uint8_t ch, int16_t t) {
+	if (t > SAFE_TEMP_MAX)
+		safe_trip(FAULT_OVERTEMP | ch << FAULT_CH);
+	else if (sampleSeq > 1 && t - TEMP[ch] > SAFE_JUMP)
+		safe_trip(FAULT_RISE | ch << FAULT_CH);
+}
+
+/*! \brief Once per second: command timeout and stuck sensors.
+ * A heater that ran at SAFE_STUCK_DUTY or more for a whole window of
+ * SAFE_STUCK_S seconds must have moved its sensor.
+ */
+static void safe_second(void) {
+	uint8_t ch, t;
+
+	if (!heating())
+		safeIdle = 0;
+	else if (TWI_TxBuf.b[REG_TIMEOUT] && ++safeIdle >= TWI_TxBuf.b[REG_TIMEOUT])
+		safe_trip(FAULT_TIMEOUT);
+
+	for (ch = 0; ch < 2; ch++) {
+		t = temp_meas(ch) >> 5;
+		if (!safeWin) {
+			safeRef[ch] = t;
+			safeHot |= 1 << ch;
+		}
+		if (heatOut[ch] < SAFE_STUCK_DUTY)
+			safeHot &= ~(1 << ch);
+		if (safeWin == SAFE_STUCK_S - 1 && (safeHot & (1 << ch))
+				&& t < safeRef[ch] + SAFE_STUCK_RISE)
+			safe_trip(FAULT_STUCK | ch << FAULT_CH);
+	}
+	if (++safeWin == SAFE_STUCK_S)
+		safeWin = 0;
+}
+
+#ifdef OFEN_FAN_CTL
+/*! \brief Speed control, once per second with a target set.
+ * The controller is integral only, REG_FAN is its state.
+ */
+static void fan_ctl(uint16_t rpm) {
+	int16_t e = ((int16_t) (TWI_TxBuf.w[REG_RPM_SET >> 1] - rpm)) / FAN_RPM_STEP;
+
+	if (e > FAN_STEP_MAX)
+		e = FAN_STEP_MAX;
+	else if (e < -FAN_STEP_MAX)
+		e = -FAN_STEP_MAX;
+	e += TWI_TxBuf.b[REG_FAN];
+	if (e > 0xFF)
+		e = 0xFF;
+	else if (e < FAN_DUTY_MIN)
+		e = FAN_DUTY_MIN;
+	TWI_TxBuf.b[REG_FAN] = e;
+	set_fan(e);
+}
+#endif
+
+/*! \brief Once per second: fan speed, stall flag and speed control.
+ */
+static void fan_second(void) {
+	uint8_t n, duty = TWI_TxBuf.b[REG_FAN];
+	uint16_t rpm;
+
+	cli();
+	n = fanTach;
+	fanTach = 0;
+	sei();
+	rpm = n * (60 / FAN_PPR);
+	TWI_TxBuf.w[REG_RPM >> 1] = rpm;
+
+	if (!n && duty && fanWin)
+		TWI_TxBuf.b[REG_STATUS] |= 1 << REG_STATUS_STALL;
+	else
+		TWI_TxBuf.b[REG_STATUS] &= ~(1 << REG_STATUS_STALL);
+	fanWin = duty;
+
+#ifdef OFEN_FAN_CTL
+	if (TWI_TxBuf.w[REG_RPM_SET >> 1])
+		fan_ctl(rpm);
+#endif
+}
+
+// controller parameter, register file and eeprom
+static void pid_param(uint8_t ch, uint8_t i, int16_t v) {
+	TWI_TxBuf.w[(REG_PID_OH >> 1) + 4 * ch + i] = v;
+	pid_set_param(&pid[ch], i, v);
+	eeprom_update_word((uint16_t *) &eePid[ch][i], v);
+}
+
+#ifdef OFEN_TUNE
+static void tune_state(uint8_t state) {
+	tuneState = state;
+	TWI_TxBuf.b[REG_TUNE] = state;
+}
+
+// heater of the tuned channel off, then state
+static void tune_end(uint8_t state) {
+	uint8_t ch = tuneState >> TUNE_CH;
+
+	if (!tune_running())
+		return;
+	set_heater(ch, 0);
+	tune_state(state | ch << TUNE_CH);
+}
+
+// mean period and amplitude to PI gains
+static void tune_gains(uint8_t ch) {
+	uint16_t tu = TWI_TxBuf.w[REG_TUNE_TU >> 1] / TUNE_CYCLES;
+	uint16_t amp = TWI_TxBuf.w[REG_TUNE_AMP >> 1] / TUNE_CYCLES;
+	uint32_t kp, ki;
+
+	TWI_TxBuf.w[REG_TUNE_TU >> 1] = tu;
+	TWI_TxBuf.w[REG_TUNE_AMP >> 1] = amp;
+	if (!amp) {
+		tune_end(TUNE_FAIL);
+		return;
+	}
+	kp = (uint32_t) TWI_TxBuf.b[REG_TUNE_DUTY] * TUNE_KP / amp;
+	if (kp > INT16_MAX)
+		kp = INT16_MAX;
+	ki = kp * 5 / (11UL * tu); // kp / (2.2 tu)
+	pid_param(ch, PID_PARAM_KP, kp);
+	pid_param(ch, PID_PARAM_KI, ki ? ki : 1);
+	pid_param(ch, PID_PARAM_KD, 0);
+	tune_end(TUNE_DONE);
+}
+
+/*! \brief One sample of the tuned channel, returns its heater duty.
+ * The relay starts on. Every switch-on ends a cycle, the first one the
+ * heat-up and the first cool-down. From
+ * there on REG_TUNE_TU counts samples and every cycle adds its peak to
+ * peak swing to REG_TUNE_AMP.
+ */
+static uint16_t tune_sample(uint8_t ch, int16_t t) {
+	int16_t sp = TWI_TxBuf.w[REG_TUNE_SET >> 1];
+	uint16_t *tu = &TWI_TxBuf.w[REG_TUNE_TU >> 1];
+	uint8_t n;
+
+	if (t > tuneMax)
+		tuneMax = t;
+	if (t < tuneMin)
+		tuneMin = t;
+
+	if (tuneCycle & TUNE_ON) {
+		if (t > sp + TUNE_HYST)
+			tuneCycle &= ~TUNE_ON;
+	} else if (t < sp - TUNE_HYST) {
+		n = ++tuneCycle;
+		if (n == 1)
+			*tu = 0; // measuring from here
+		else
+			TWI_TxBuf.w[REG_TUNE_AMP >> 1] += tuneMax - tuneMin;
+		tuneMax = tuneMin = t;
+		if (n > TUNE_CYCLES) {
+			tune_gains(ch);
+			return 0;
+		}
+		tuneCycle |= TUNE_ON;
+	}
+
+	if (++*tu == 0xFFFF) {
+		tune_end(TUNE_FAIL);
+		return 0;
+	}
+	return tuneCycle & TUNE_ON ? (uint16_t) TWI_TxBuf.b[REG_TUNE_DUTY] << 8 : 0;
+}
+#else
+#define tune_end(state) ((void) 0)
+#endif
+
+static uint8_t prof_running(void) {
+	uint8_t s = profState & ~PROF_PAUSED;
+	return s == PROF_RAMP || s == PROF_SOAK;
+}
+
+#ifdef OFEN_PROFILE
+static uint16_t prof_word(uint8_t off) {
+	return eeprom_read_word((const uint16_t *) &eeProf[off]);
+}
+
+static void prof_state(uint8_t state) {
+	profState = state;
+	TWI_TxBuf.b[REG_PROF] = state;
+}
+
+// both heaters follow the profile
+static void prof_setpoint(uint16_t setpoint) {
+	set_control(0, setpoint);
+	set_control(1, setpoint);
+}
+
+// start segment n, past the last one the profile is done
+static void prof_segment(uint8_t n) {
+	TWI_TxBuf.b[REG_PROF_STEP] = n;
+	TWI_TxBuf.w[REG_PROF_TIME >> 1] = 0;
+	if (n >= PROF_SEGS || n >= eeprom_read_byte(&eeProf[0])) {
+		prof_setpoint(0);
+		prof_state(PROF_DONE);
+		return;
+	}
+	TWI_TxBuf.b[REG_FAN] = eeprom_read_byte(&eeProf[PROF_SEG(n) + PROF_SEG_FAN]);
+	TWI_TxBuf.w[REG_RPM_SET >> 1] = 0;
+	set_fan(TWI_TxBuf.b[REG_FAN]);
+	profRem = 0;
+	prof_state(PROF_RAMP);
+}
+
+/*! \brief One second of the running profile.
+ * Ramp: move the setpoint by rate / 60, REG_PROF_TIME is the estimated
+ * time to target. Soak: count REG_PROF_TIME down, then the next segment.
+ */
+static void prof_second(void) {
+	uint8_t off = PROF_SEG(TWI_TxBuf.b[REG_PROF_STEP]);
+	uint16_t *time = &TWI_TxBuf.w[REG_PROF_TIME >> 1];
+	uint16_t sp = TWI_TxBuf.w[REG_SET_OH >> 1];
+	uint16_t target = prof_word(off + PROF_SEG_TARGET);
+	uint16_t rate = prof_word(off + PROF_SEG_RATE);
+	uint16_t left, d;
+	uint8_t r;
+
+	if (profState == PROF_SOAK) {
+		if (*time)
+			(*time)--;
+		if (!*time)
+			prof_segment(TWI_TxBuf.b[REG_PROF_STEP] + 1);
+		return;
+	}
+
+	left = sp > target ? sp - target : target - sp;
+	d = rate / 60;
+	r = rate % 60 + profRem;
+	if (r >= 60) {
+		r -= 60;
+		d++;
+	}
+	profRem = r;
+
+	if (!rate || d >= left) {
+		prof_setpoint(target);
+		*time = prof_word(off + PROF_SEG_HOLD);
+		prof_state(PROF_SOAK);
+		return;
+	}
+	prof_setpoint(sp > target ? sp - d : sp + d);
+	*time = ((uint32_t) (left - d) * 60 + rate - 1) / rate;
+}
+
+/*! \brief Profile image port, see registers.h.
+ * A write stores the byte at the pointer and moves it on, REG_PROF_DATA
+ * then shows the byte at the pointer.
+ */
+static void prof_port(uint8_t write) {
+	uint8_t ptr = TWI_TxBuf.b[REG_PROF_PTR];
+
+	if (write && !prof_running() && ptr < PROF_IMAGE_SIZE) {
+		eeprom_update_byte(&eeProf[ptr], TWI_TxBuf.b[REG_PROF_DATA]);
+		TWI_TxBuf.b[REG_PROF_PTR] = ++ptr;
+	}
+	TWI_TxBuf.b[REG_PROF_DATA] = ptr < PROF_IMAGE_SIZE ? eeprom_read_byte(&eeProf[ptr]) : 0xFF;
+}
+#else
+#define prof_state(state) ((void) 0)
+#define prof_setpoint(setpoint) ((void) 0)
+#endif
+
+#ifdef OFEN_JOURNAL
+/* control state journal, see registers.h
+ * Payload of a journal.h record, 16 bit fields little endian:
+ *  [set oh | set uh | duty oh | duty uh | rpm set | prof time | fan | timeout | prof | step]
+ * Duties only without a controller or tune run on the channel, the fan
+ * only without speed control.
+ */
+#define JRN_SET     0
+#define JRN_DUTY    4
+#define JRN_RPM     8
+#define JRN_TIME    10
+#define JRN_FAN     12
+#define JRN_TIMEOUT 13
+#define JRN_PROF    14
+#define JRN_STEP    15
+#define JRN_REFRESH 60	// seconds between records at least, the refresh of a running profile
+static uint8_t jrnAge = 0xFF;	// seconds since the last record, sticks at 255
+
+static uint8_t jrn_byte(uint8_t i) {
+	uint8_t ch = (i >> 1) & 1;
+	uint16_t w;
+
+	if (i < JRN_DUTY)
+		w = TWI_TxBuf.w[(REG_SET_OH >> 1) + ch];
+	else if (i < JRN_RPM)
+		w = pid[ch].setpoint || tuneState == (TUNE_RUN | ch << TUNE_CH) ? 0 : heatDuty[ch];
+	else if (i < JRN_TIME)
+		w = TWI_TxBuf.w[REG_RPM_SET >> 1];
+	else if (i < JRN_FAN)
+		w = TWI_TxBuf.w[REG_PROF_TIME >> 1];
+	else if (i == JRN_FAN)
+		return TWI_TxBuf.w[REG_RPM_SET >> 1] ? 0 : TWI_TxBuf.b[REG_FAN];
+	else if (i == JRN_TIMEOUT)
+		return TWI_TxBuf.b[REG_TIMEOUT];
+	else if (i == JRN_PROF)
+		return profState;
+	else
+		return TWI_TxBuf.b[REG_PROF_STEP];
+	return i & 1 ? w >> 8 : w;
+}
+
+static uint16_t jrn_word(uint8_t i) {
+	return journal_read(i) | journal_read(i + 1) << 8;
+}
+
+/*! \brief Start a record when the state differs from the newest one.
+ * At most every JRN_REFRESH seconds, a master ramping a setpoint by
+ * itself wears the eeprom no faster than a profile. The ramp setpoint and
+ * REG_PROF_TIME of a running profile are only taken along with the refresh.
+ */
+static void jrn_second(void) {
+	uint8_t i, run = prof_running() && !(profState & PROF_PAUSED);
+
+	if (jrnAge != 0xFF)
+		jrnAge++;
+	if (journal_busy() || jrnAge < JRN_REFRESH)
+		return;
+	for (i = 0; i < JOURNAL_DATA; i++) {
+		if ((i & ~1) == JRN_TIME || (run && i < JRN_DUTY))
+			continue;
+		if (jrn_byte(i) != journal_read(i))
+			break;
+	}
+	if (i < JOURNAL_DATA || run) {
+		journal_begin();
+		jrnAge = 0;
+	}
+}
+
+/*! \brief Pick up the journaled state after a reset, before the first sample.
+ * A latched fault (the watchdog reset the chip) keeps the heaters off.
+ */
+static void jrn_resume(void) {
+	uint8_t ch;
+
+	for (ch = 0; ch < 2; ch++) {
+		set_control(ch, jrn_word(JRN_SET + 2 * ch));
+		if (!pid[ch].setpoint && !FAULT)
+			set_heater(ch, jrn_word(JRN_DUTY + 2 * ch));
+	}
+	TWI_TxBuf.w[REG_RPM_SET >> 1] = jrn_word(JRN_RPM);
+	TWI_TxBuf.b[REG_FAN] = TWI_TxBuf.w[REG_RPM_SET >> 1] ? FAN_DUTY_MIN : journal_read(JRN_FAN);
+	set_fan(TWI_TxBuf.b[REG_FAN]);
+	TWI_TxBuf.b[REG_TIMEOUT] = journal_read(JRN_TIMEOUT);
+
+	// the profile goes on from the last record, the setpoints came with it
+	prof_state(journal_read(JRN_PROF));
+	if (FAULT || !prof_running())
+		prof_state(PROF_IDLE);
+	else {
+		TWI_TxBuf.b[REG_PROF_STEP] = journal_read(JRN_STEP);
+		TWI_TxBuf.w[REG_PROF_TIME >> 1] = jrn_word(JRN_TIME);
+	}
+	TWI_TxBuf.b[REG_STATUS] |= 1 << REG_STATUS_RESUMED;
+}
+#endif
+
+static void task_run(uint8_t task) {
+	switch (task) {
+	case TASK_SAFE:
+		safe_second();
+		break;
+	case TASK_FAN:
+		fan_second();
+		break;
+	case TASK_PROF:
+#ifdef OFEN_PROFILE
+		if (prof_running() && !(profState & PROF_PAUSED))
+			prof_second();
+#endif
+#ifdef OFEN_JOURNAL
+		jrn_second(); // after the profile moved on
+#endif
+		break;
+	}
+}
+
+/*! \brief Advance the scheduler clock and run the due tasks.
+ */
+static void sched_run(void) {
+	uint8_t i, d = t0Ticks - schedT0;
+	int16_t late;
+
+	schedT0 += d;
+	schedNow += d;
+	for (i = 0; i < TASKS; i++) {
+		late = schedNow - taskNext[i];
+		if (late < 0)
+			continue;
+		if (late > pgm_read_byte(&tasks[i].deadline))
+			TWI_TxBuf.b[REG_TASK_OVERRUN]++;
+		taskNext[i] += pgm_read_word(&tasks[i].period);
+		{
+			DIAG_ENTER();
+			task_run(i);
+			DIAG_LEAVE(diagMaxTask);
+		}
+	}
+}
+
+// registers of the build options, read-only if left out (registers.h)
+#ifdef OFEN_PROFILE
+#define WR_PROF 0xFF
+#else
+#define WR_PROF 0x00
+#endif
+#ifdef OFEN_FAN_CTL
+#define WR_FAN_CTL 0xFF
+#else
+#define WR_FAN_CTL 0x00
+#endif
+#ifdef OFEN_TUNE
+#define WR_TUNE 0xFF
+#else
+#define WR_TUNE 0x00
+#endif
+#ifdef OFEN_FILTER
+#define WR_FILTER 0xFF
+#else
+#define WR_FILTER 0x00
+#endif
+#ifdef OFEN_PEAK
+#define WR_PEAK 0xFF
+#else
+#define WR_PEAK 0x00
+#endif
+#ifdef OFEN_ALERT
+#define WR_ALERT 0xFF
+#else
+#define WR_ALERT 0x00
+#endif
+
+// writable registers, one bit per register
+static const uint8_t reg_writable[TWI_TX_BUFFER_SIZE / 8] PROGMEM = {
+	0xC2, // 0x00: REG_FAN, REG_SET_OH
+	0x3F, // 0x08: REG_SET_UH, REG_DUTY_*
+	0xFF, // 0x10: REG_PID_OH
+	0xFF, // 0x18: REG_PID_UH
+	0xC1 | (WR_PEAK & 0x0E) | (WR_FILTER & 0x30), // 0x20: REG_POWER, REG_PEAK, REG_RATING_*, REG_FILTER_*, REG_ADDRESS, REG_GROUP
+	0xF0, // 0x28: REG_TRIM_OH
+	0x0F | (WR_PROF & 0x10), // 0x30: REG_TRIM_UH, REG_PROF
+	0x0C | (WR_PROF & 0x03) | (WR_FAN_CTL & 0xC0), // 0x38: REG_PROF_PTR, REG_PROF_DATA, REG_FAULT, REG_TIMEOUT, REG_RPM_SET
+	(WR_ALERT & 0x3D) | (WR_TUNE & 0xC0), // 0x40: REG_ALERT, REG_ALERT_HI, REG_ALERT_LO, REG_TUNE_SET
+	WR_TUNE & 0x03, // 0x48: REG_TUNE_DUTY, REG_TUNE
+	0x01, // 0x50: REG_BOOT
+	0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+/*! \brief Hand the chip to the bootloader, see REG_BOOT. Does not return.
+ * The bootloader stops timers and interrupts itself.
+ */
+static void boot_enter(void) {
+	cli();
+	TCCR1A = 0x02; // heaters off like safe_trip()
+	PORTA |= (1 << PA7);
+	GPIOR1 = TWI_TxBuf.b[REG_ADDRESS];
+	GPIOR2 = BOOT_MAGIC;
+	BOOT_ENTRY();
+}
+
+/*! \brief Side effects of a register write.
+ * Called for every byte written by the master, after it was stored in the
+ * register file. 16 bit registers act on their high byte.
+ */
+static void reg_write(uint8_t reg) {
+	uint8_t ch;
+	uint16_t duty;
+	cal_trim_t trim;
+
+	switch (reg) {
+	case REG_FAN:
+		TWI_TxBuf.w[REG_RPM_SET >> 1] = 0;
+		set_fan(TWI_TxBuf.b[REG_FAN]);
+		break;
+
+#ifdef OFEN_FAN_CTL
+		// luefter drehzahl, the controller starts from FAN_DUTY_MIN
+	case REG_RPM_SET + 1:
+		if (TWI_TxBuf.w[REG_RPM_SET >> 1] && TWI_TxBuf.b[REG_FAN] < FAN_DUTY_MIN) {
+			TWI_TxBuf.b[REG_FAN] = FAN_DUTY_MIN;
+			set_fan(FAN_DUTY_MIN);
+		}
+		break;
+#endif
+
+		// solltemperatur, regelung laeuft bei jedem neuen messwert
+	case REG_SET_OH + 1:
+	case REG_SET_UH + 1:
+		ch = (reg - REG_SET_OH) >> 1;
+		prof_state(PROF_IDLE);
+		tune_end(TUNE_IDLE);
+		set_control(ch, TWI_TxBuf.w[reg >> 1]);
+		break;
+
+		// heizung direkt
+	case REG_DUTY_OH + 1:
+	case REG_DUTY_UH + 1:
+		ch = (reg - REG_DUTY_OH) >> 1;
+		duty = TWI_TxBuf.w[reg >> 1]; // set_control() clears the register
+		prof_state(PROF_IDLE);
+		tune_end(TUNE_IDLE);
+		set_control(ch, 0);
+		set_heater(ch, duty);
+		break;
+
+#ifdef OFEN_FILTER
+		// messwert filter
+	case REG_FILTER_OH:
+	case REG_FILTER_UH:
+		adcFilter[reg - REG_FILTER_OH] = TWI_TxBuf.b[reg];
+		break;
+#endif
+
+		// leistungsverteilung
+	case REG_POWER:
+#ifdef OFEN_PEAK
+	case REG_PEAK:
+	case REG_RATING_OH:
+	case REG_RATING_UH:
+#endif
+		heater_apply();
+		break;
+
+		// busadresse, gilt ab der naechsten startbedingung
+	case REG_ADDRESS:
+		if (TWI_TxBuf.b[reg] < 0x08 || TWI_TxBuf.b[reg] > 0x77) {
+			TWI_TxBuf.b[reg] = twiAddress;
+			break;
+		}
+		twiAddress = TWI_TxBuf.b[reg];
+		eeprom_update_byte(&eeAddress, twiAddress);
+		USI_TWI_Slave_Address(twiAddress);
+		break;
+
+	case REG_GROUP:
+		eeprom_update_byte(&eeGroup, TWI_TxBuf.b[reg]);
+		break;
+
+		// abgleich, gilt ab dem naechsten messwert
+	case REG_TRIM_OH + 1:
+	case REG_TRIM_OH + 3:
+	case REG_TRIM_UH + 1:
+	case REG_TRIM_UH + 3:
+		ch = (reg - REG_TRIM_OH) >> 2;
+		trim_get(ch, &trim);
+		cal_store(ch, &trim);
+		break;
+
+#ifdef OFEN_PROFILE
+		// programm
+	case REG_PROF:
+		switch (TWI_TxBuf.b[REG_PROF]) {
+		case PROF_CMD_START:
+			if (FAULT)
+				break;
+			tune_end(TUNE_IDLE);
+			prof_setpoint(temp_meas(0));
+			prof_segment(0);
+			break;
+		case PROF_CMD_PAUSE:
+			if (prof_running())
+				profState |= PROF_PAUSED;
+			break;
+		case PROF_CMD_RESUME:
+			profState &= ~PROF_PAUSED;
+			break;
+		case PROF_CMD_ABORT:
+			if (prof_running())
+				prof_setpoint(0);
+			profState = PROF_IDLE;
+			break;
+		}
+		prof_state(profState);
+		break;
+
+		// programm upload
+	case REG_PROF_DATA:
+	case REG_PROF_PTR:
+		prof_port(reg == REG_PROF_DATA);
+		break;
+#endif
+
+#ifdef OFEN_TUNE
+		// selbstoptimierung, see tune_sample()
+	case REG_TUNE:
+		ch = TWI_TxBuf.b[REG_TUNE];
+		if ((ch & ~(1 << TUNE_CH)) == TUNE_CMD_START && !FAULT) {
+			tune_end(TUNE_IDLE);
+			ch >>= TUNE_CH;
+			if (prof_running())
+				prof_setpoint(0);
+			prof_state(PROF_IDLE);
+			set_control(ch, 0);
+			TWI_TxBuf.w[REG_TUNE_TU >> 1] = 0;
+			TWI_TxBuf.w[REG_TUNE_AMP >> 1] = 0;
+			tuneCycle = TUNE_ON; // heat up to the first switch-off
+			tune_state(TUNE_RUN | ch << TUNE_CH);
+			break;
+		}
+		if (ch == TUNE_CMD_ABORT)
+			tune_end(TUNE_IDLE);
+		tune_state(tuneState);
+		break;
+#endif
+
+		// firmware update
+	case REG_BOOT:
+		if (TWI_TxBuf.b[REG_BOOT] == BOOT_MAGIC)
+			boot_enter();
+		TWI_TxBuf.b[REG_BOOT] = 0;
+		break;
+
+		// quittieren, a lasting cause trips again
+	case REG_FAULT:
+		FAULT = 0;
+		safeWin = 0;
+		break;
+
+	default:
+		// regler parameter
+		if (reg >= REG_PID_OH && reg < REG_PID_UH + 8 && (reg & 1)) {
+			ch = reg - REG_PID_OH;
+			pid_param(ch >> 3, (ch >> 1) & 3, TWI_TxBuf.w[reg >> 1]);
+		}
+		break;
+	}
+}
+
+/*! \brief Apply all queued write frames, oldest first.
+ */
+static void twi_frames(void) {
+	int8_t len;
+	uint8_t i, reg, general;
+
+	while ((len = USI_TWI_Data_In_Receive_Buffer()) > 0) {
+		i = 1;
+		general = USI_TWI_General_Call();
+		if (general) {
+			// group frame, see registers.h
+			reg = USI_TWI_Receive_Byte(0);
+			if (reg != GROUP_ALL && !(reg & TWI_TxBuf.b[REG_GROUP]))
+				len = 0;
+			i = 2;
+		}
+		reg = USI_TWI_Receive_Byte(i - 1);
+		if (i < len) // the master took over, not just a read pointer
+			TWI_TxBuf.b[REG_STATUS] &= ~(1 << REG_STATUS_RESUMED);
+		for (; i < len; i++, reg++) {
+			reg &= TWI_TX_BUFFER_MASK;
+			if (!(pgm_read_byte(&reg_writable[reg >> 3]) & (1 << (reg & 7))))
+				continue;
+			if (general && reg == REG_ADDRESS)
+				continue;
+			TWI_TxBuf.b[reg] = USI_TWI_Receive_Byte(i);
+			reg_write(reg);
+			safeIdle = 0;
+			if (reg == REG_PROF_DATA)
+				reg--; // port, the pointer stays
+		}
+		USI_TWI_Release_Receive_Buffer();
+#ifdef TWI_DIAG
+		TWI_TxBuf.w[REG_DIAG_FRAMES >> 1]++;
+#endif
+	}
+}
+
+/*! \brief Publish each channel whose filter is done and run its controller.
+ * Returns 1 if there was a new sample.
+ */
+static uint8_t samples(void) {
+	uint8_t i, fresh = 0;
+	uint16_t raw;
+	int16_t t;
+	cal_trim_t trim;
+
+	for (i = 0; i < 2; i++) {
+		if (!(adcCnt & (1 << (ADCCNT_NEW + i))))
+			continue;
+		cli();
+		adcCnt &= ~(1 << (ADCCNT_NEW + i));
+		raw = adcIir[i] >> 2;
+		sei();
+		TWI_TxBuf.w[(REG_TEMP_OH >> 1) + i] = raw;
+		trim_get(i, &trim);
+		t = cal_convert(raw, &trim);
+		safe_sample(i, t);
+		TEMP[i] = t;
+		if (!histDiv--) {
+			histDiv = HIST_DIV - 1;
+			hist_log();
+		}
+
+		if (sampleSeq < 2) // no derivative kick from the resumed setpoint
+			pid[i].last = temp_meas(i);
+		if (pid[i].setpoint)
+			heatDuty[i] = pid_update(&pid[i], temp_meas(i));
+#ifdef OFEN_TUNE
+		else if (tuneState == (TUNE_RUN | i << TUNE_CH))
+			heatDuty[i] = tune_sample(i, t);
+#endif
+		heater_apply();
+		snap_publish();
+#ifdef TWI_DIAG
+		USI_TWI_Diag(&TWI_TxBuf.b[REG_DIAG_RX_OVERFLOW]);
+		TWI_TxBuf.b[REG_DIAG_MAX_T0] = diagMaxT0;
+		TWI_TxBuf.b[REG_DIAG_MAX_ADC] = diagMaxAdc;
+		TWI_TxBuf.b[REG_DIAG_MAX_TASK] = diagMaxTask;
+#endif
+		sampleSeq++;
+		fresh = 1;
+	}
+	return fresh;
+}
+
 int main(void) {
 	unsigned char TWI_slaveAddress;
-	int8_t RX_start, TX_start = 0;
-	adcAccu[0] = 0;
-	adcAccu[1] = 0;
+	uint8_t i, d;
+	int16_t t;
+	cal_trim_t trim;
+
+	// after a watchdog reset it stays on with the shortest timeout
+	d = MCUSR;
+	MCUSR = 0;
+	wdt_disable();
+
 	adcCnt = 0;
+	pid_init(&pid[0]);
+	pid_init(&pid[1]);
+	for (i = 0; i < 8; i++) {
+		t = eeprom_read_word((const uint16_t *) &eePid[i >> 2][i & 3]);
+		if (t == -1) // erased
+			t = pid_get_param(&pid[i >> 2], i & 3);
+		pid_set_param(&pid[i >> 2], i & 3, t);
+		TWI_TxBuf.w[(REG_PID_OH >> 1) + i] = t;
+	}
+#ifdef OFEN_TUNE
+	TWI_TxBuf.b[REG_TUNE_DUTY] = TUNE_DUTY_DEFAULT;
+#endif
+	for (i = 0; i < 2; i++) {
+		cal_load(i, &trim);
+		TWI_TxBuf.w[(REG_TRIM_OH >> 1) + 2 * i] = trim.offset;
+		TWI_TxBuf.w[(REG_TRIM_OH >> 1) + 2 * i + 1] = trim.gain;
+	}
+#ifdef OFEN_PROFILE
+	prof_port(0);
+#endif
+	TWI_TxBuf.b[REG_FILTER_OH] = ADC_FILTER(0);
+	TWI_TxBuf.b[REG_FILTER_UH] = ADC_FILTER(1);
+	for (i = 0; i < TASKS; i++)
+		taskNext[i] = pgm_read_word(&tasks[i].period);
 
-	clock_prescale_set(clock_div_2);
+	clock_prescale_set(USI_TWI_CLOCK_DIV);
 
 	// Input/Output Ports initialization
 	// Port A initialization
@@ -53,23 +1216,27 @@ int main(void) {
 	DDRA = 0xA0;
 
 	// Port B initialization
-	// Func3=In Func2=Out Func1=In Func0=In
-	// State3=T State2=0 State1=T State0=T
-	PORTB = 0x00;
+	// Func3=In Func2=Out Func1=In Func0=In (alert, open drain)
+	// State3=T State2=0 State1=P State0=T
+	PORTB = 0x02;
 	DDRB = 0x04;
 
+	// fan tach on PB1 (PCINT9)
+	PCMSK1 = 1 << PCINT9;
+	GIMSK |= 1 << PCIE1;
+
 	// Timer/Counter 0 initialization
 	// Clock source: System Clock
-	// Clock value: 25,600 kHz
+	// Clock value: 204,800 kHz (overflow 800 Hz, adc pacing)
 	// Mode: Fast PWM top=FFh
 	// OC0A output: Disconnected
 	// OC0B output: Disconnected
 	TCCR0A = 0x03;
-	TCCR0B = 0x03;
+	TCCR0B = 0x02;
 	TCNT0 = 0x00;
 	OCR0A = 0x00;
 	OCR0B = 0x00;
-	TIMSK0 = 1 << TOIE0; // enable timer0 interrupt
+	TIMSK0 = 1 << TOIE0;
 
 
 	// Timer/Counter 1 initialization
@@ -108,12 +1275,13 @@ int main(void) {
 	// ADC initialization
 	// ADC Clock frequency: 51.200 kHz
 	// ADC Bipolar Input Mode: Off
-	// ADC Auto Trigger Source: ADC Stopped
+	// ADC Auto Trigger: Off, started by noise reduction sleep. A timer0
+	// trigger would convert while the cpu runs, so timer0 only paces.
 	// Digital input buffers on ADC0: Off, ADC1: Off, ADC2: Off, ADC3: Off
 	// ADC4: On, ADC5: On, ADC6: On, ADC7: On
 	DIDR0 = 0x0F;
-	ADCSRA = 0x8D;
-	ADCSRB &= 0x6F;
+	ADCSRB = 0x00;
+	ADCSRA = 0x9D;
 
 	// 1 0 Internal 1.1V voltage reference
 	ADMUX = 0x80;
@@ -123,124 +1291,96 @@ int main(void) {
 	ADMUX |= 0x10;
 
 	// Own TWI slave address
-	TWI_slaveAddress = 0x50;
-	USI_TWI_Slave_Initialise(TWI_slaveAddress, &TWI_RxBuf, &TWI_TxBuf);
+	TWI_slaveAddress = eeprom_read_byte(&eeAddress);
+	if (TWI_slaveAddress < 0x08 || TWI_slaveAddress > 0x77)
+		TWI_slaveAddress = TWI_ADDRESS_DEFAULT;
+	twiAddress = TWI_slaveAddress;
+	TWI_TxBuf.b[REG_ADDRESS] = TWI_slaveAddress;
+	TWI_TxBuf.b[REG_GROUP] = eeprom_read_byte(&eeGroup);
+	USI_TWI_Slave_Initialise(TWI_slaveAddress, &TWI_TxBuf);
 
-	set_sleep_mode(SLEEP_MODE_IDLE);
-	sei();
-	// This loop runs forever. If the TWI Transceiver is busy the execution will just continue doing other operations.
+	if (d & (1 << WDRF))
+		FAULT = FAULT_RESET;
+#ifdef OFEN_JOURNAL
+	if (journal_init())
+		jrn_resume();
+#endif
+	wdt_enable(SAFE_WDT);
+	WDTCSR |= 1 << WDIE; // interrupt first, reset on the next timeout
 
-	USI_TWI_Set_TX_Start(TX_start);
+	sei();
+	// This loop runs forever: event work, the due tasks, then sleep until the next interrupt.
 
 	for (;;) {
-		if ((RX_start = USI_TWI_Data_In_Receive_Buffer()) != -1) {
-			switch (TWI_RxBuf.b[RX_start]) {
-
-				// beide heizungen
-			case 0: {
-				OCR1B = (TWI_RxBuf.b[RX_start + 1] << 4) + 0x0F;
-				OCR1A = (TWI_RxBuf.b[RX_start + 2] << 4) + 0x0F;
-				//TCNT1=0x0FF0;
-				if (TWI_RxBuf.b[RX_start + 1])
-					TCCR1A = 0x32;
-				else
-					TCCR1A = 0x02;
-				if (TWI_RxBuf.b[RX_start + 2]) {
-					TIFR1 = 0x03;
-					TIMSK1 = 0x03;
-				} else {
-					TIMSK1 = 0x02;
-					PORTA |= (1 << PA7);
-				}
-				break;
-			}
-
-				// obere hitze
-			case 1: {
-				OCR1B = (TWI_RxBuf.b[RX_start + 1] << 4) + 0x0F;
-				if (TWI_RxBuf.b[RX_start + 1])
-					TCCR1A = 0x32;
-				else
-					TCCR1A = 0x02;
-				break;
-			}
+		twi_frames();
 
-				// untere hitze
-			case 2: {
-				OCR1A = (TWI_RxBuf.b[RX_start + 1] << 4) + 0x0F;
-				if (TWI_RxBuf.b[RX_start + 1]) {
-					TIFR1 = 0x03;
-					TIMSK1 = 0x03;
-				} else {
-					TIMSK1 = 0x02;
-					PORTA |= (1 << PA7);
-				}
-				break;
-			}
+		TWI_TxBuf.b[REG_HIST_COUNT] = USI_TWI_FIFO_Count() / HIST_ENTRY_SIZE;
+		TWI_TxBuf.b[REG_RX_DROPPED] = USI_TWI_Rx_Dropped();
 
-				// luefter
-			case 3: {
-				OCR0A = TWI_RxBuf.b[RX_start + 1];
-				if (OCR0A)
-					TCCR0A = 0x83;
-				else
-					TCCR0A = 0x03;
-				break;
+		// tripped: drop what would switch the heaters back on
+		if (FAULT) {
+			TWI_TxBuf.b[REG_STATUS] |= 1 << REG_STATUS_FAULT;
+			tune_end(TUNE_FAIL);
+			if (heating()) {
+				prof_state(PROF_IDLE);
+				set_control(0, 0);
+				set_control(1, 0);
 			}
+		} else
+			TWI_TxBuf.b[REG_STATUS] &= ~(1 << REG_STATUS_FAULT);
 
-			default:
-				break;
-			} // switch
-		} // if RX_start
-
-		if (adcCnt & (1 << ADCCNT_SHIFT)) {
-			TX_start = (TX_start + 4) & TWI_TX_BUFFER_MASK;
-			adcCnt &= ~(1 << ADCCNT_SHIFT);
-			TIMSK0 = 0;
-			TWI_TxBuf.w[TX_start >> 1] = adcAccu[0] >> 2;
-			TWI_TxBuf.w[(TX_start >> 1) + 1] = adcAccu[1] >> 2;
-			adcAccu[0] = 0;
-			adcAccu[1] = 0;
-			TIMSK0 = 1 << TOIE0;
-			USI_TWI_Set_TX_Start(TX_start);
+		// once per timer1 period, ICF1 is set at TOP (ICR1)
+		if (TIFR1 & (1 << ICF1)) {
+			TIFR1 = 1 << ICF1;
+			pwm_update(1);
 		}
 
+		// one sample per channel, published as soon as its filter is done
+		alert_update(samples());
+
+		sched_run();
+#ifdef OFEN_JOURNAL
+		journal_poll(jrn_byte);
+#endif
 
+		/* power manager
+		 * Every conversion runs in adc noise reduction sleep, in between the
+		 * cpu idles. The usi overflow can't wake the cpu from noise reduction,
+		 * so during a transfer the conversion runs in idle sleep instead of
+		 * holding SCL for up to a conversion time. With the heaters, the fan and the bus idle the clock
+		 * drops to CLOCK_STANDBY (timer0, adc and timer1 slow down with it),
+		 * the start condition isr restores USI_TWI_CLOCK_DIV.
+		 */
 		cli();
+		if (!heating() && !TWI_TxBuf.b[REG_FAN] && !prof_running() && USI_TWI_Bus_Idle())
+			clock_prescale_set(CLOCK_STANDBY);
+		else
+			clock_prescale_set(USI_TWI_CLOCK_DIV);
+		if ((adcCnt & (1 << ADCCNT_DUE)) && !(ADCSRA & (1 << ADSC))) {
+			adcCnt &= ~(1 << ADCCNT_DUE);
+			if (USI_TWI_Bus_Idle()) {
+				schedFrac += NR_CYCLES;
+				if (schedFrac >= T0_CYCLES) {
+					schedFrac -= T0_CYCLES;
+					schedNow++;
+				}
+				set_sleep_mode(SLEEP_MODE_ADC); // starts the conversion
+			} else {
+				ADCSRA |= 1 << ADSC; // timer0 keeps running
+				set_sleep_mode(SLEEP_MODE_IDLE);
+			}
+		} else
+			set_sleep_mode(SLEEP_MODE_IDLE);
 		sleep_enable();
 		sei();
 		sleep_cpu();
 		sleep_disable();
 		sei();
 
-	} // for
-}
-
-ISR(TIM0_OVF_vect)
-{
-	uint8_t c;
-
-	adcCnt++;
-	c = adcCnt & 0x3f;
-
-	if (c <= 16) {
-		ADCSRA |= (1 << ADIF);	// adc-interrupt flag zuruecksetzen, wegen adc noise canceler
-		ADCSRA |= (1 << ADIE); // adc-interrupt wieder einschalten
-
-		ADCSRA |= (1 << ADSC); // start ADC Conversion
-	}
+		wdt_reset();
+		WDTCSR |= 1 << WDIE; // re-armed once main runs again
 
-	if (c == 17) {
-		if (adcCnt & (1 << ADCACCU_SEL))
-			adcCnt |= (1 << ADCCNT_SHIFT);
-
-		adcCnt ^= 1 << ADCACCU_SEL;
-	}
-
-	if (c == 25) {
-		adcCnt &= (1 << ADCCNT_SHIFT | 1 << ADCACCU_SEL); // clear lower bits
-		ADMUX ^= 0x1e; // toggle adc 1 and adc 2 mit adc3 neg input
-	}
+	} // for
 }
 
 ISR(TIM1_OVF_vect, ISR_NAKED)
@@ -255,11 +1395,105 @@ ISR(TIM1_COMPA_vect, ISR_NAKED)
 	reti();
 }
 
-ISR(ADC_vect)
+// staggered: untere hitze goes on when the obere goes off
+ISR(TIM1_COMPB_vect, ISR_NAKED)
+{
+	PORTA &= ~(1 << PA7);
+	reti();
+}
+
+// fan tach, falling edges only
+ISR(PCINT1_vect)
 {
-	uint8_t accu_selection = (adcCnt >> ADCACCU_SEL) & 1;
-	adcAccu[accu_selection] += ADCW;
-	ADCSRA &= ~(1 << ADIE); // adc-interrupt ausschalten
-	//PORTA ^= (1 << PA5);
+	if (!(PINB & (1 << PB1)) && fanTach != 0xFF)
+		fanTach++;
 }
 
+// main stalled for SAFE_WDT, the next timeout resets the chip
+ISR(WDT_vect)
+{
+	safe_trip(FAULT_WATCHDOG);
+}
+
+// next conversion due, main starts it
+ISR(TIM0_OVF_vect)
+{
+	DIAG_ENTER();
+	adcCnt |= 1 << ADCCNT_DUE;
+	t0Ticks++;
+	DIAG_LEAVE(diagMaxT0);
+}
+
+static uint16_t median3(uint16_t a, uint16_t b, uint16_t c) {
+	uint16_t t;
+	if (a > b) {
+		t = a;
+		a = b;
+		b = t;
+	}
+	if (b > c)
+		b = (a > c) ? a : c;
+	return b;
+}
+
+ISR(ADC_vect)
+{
+	uint8_t c = adcCnt;
+	uint8_t accu_selection = (c >> ADCACCU_SEL) & 1;
+	uint8_t cfg = ADC_FILTER(accu_selection);
+	uint8_t n = (cfg & ADC_FILTER_OVS_MASK) << 1;
+	uint8_t k;
+	uint16_t raw = ADCW, x = raw;
+	DIAG_ENTER();
+
+	if (adcSample < ADC_SETTLE) {
+		adcSample++;
+		DIAG_LEAVE(diagMaxAdc);
+		return;
+	}
+
+	// offener fuehler, the heaters go off before the sample is complete
+	if (raw >= SAFE_ADC_OPEN) {
+		if (++safeOpen >= SAFE_OPEN_N)
+			safe_trip(FAULT_OPEN | accu_selection << FAULT_CH);
+	} else
+		safeOpen = 0;
+
+	if (adcSample == ADC_SETTLE) {
+		adcSum = 0;
+		adcMed[0] = x;
+		adcMed[1] = x;
+	}
+
+	// spike rejection
+	if (cfg & ADC_FILTER_MEDIAN) {
+		x = median3(adcMed[0], adcMed[1], raw);
+		adcMed[0] = adcMed[1];
+		adcMed[1] = raw;
+	}
+
+	adcSum += x;
+	if (++adcSample < ADC_SETTLE + (1 << n)) {
+		DIAG_LEAVE(diagMaxAdc);
+		return;
+	}
+
+	// decimation: 4^n samples -> mean * 64
+	x = adcSum << (6 - n);
+
+	k = (cfg & ADC_FILTER_IIR_MASK) >> ADC_FILTER_IIR_POS;
+	if (!k)
+		adcIir[accu_selection] = x;
+	else if (x > adcIir[accu_selection])
+		adcIir[accu_selection] += (x - adcIir[accu_selection]) >> k;
+	else
+		adcIir[accu_selection] -= (adcIir[accu_selection] - x) >> k;
+
+	// main reads it before this channel comes round again
+	adcSample = 0;
+	c |= 1 << (ADCCNT_NEW + accu_selection);
+	c ^= 1 << ADCACCU_SEL;
+	ADMUX ^= 0x1e; // toggle adc 1 and adc 2 mit adc3 neg input
+	adcCnt = c;
+	DIAG_LEAVE(diagMaxAdc);
+}
@@ -0,0 +1,105 @@
+/*
+ * pid.c
+ *
+ * Fixed-point PID controller. There is no hardware multiplier on the
+ * ATtiny84, so the controller only runs once per published sample.
+ */
+
+#include "pid.h"
+
+// conservative defaults, tuned over TWI or by the auto-tune (REG_TUNE)
+#define PID_DEFAULT_KP   0x0400	// 4.0 duty counts per temperature count
+#define PID_DEFAULT_KI   0x0008
+#define PID_DEFAULT_KD   0x0000
+#define PID_DEFAULT_ILIM (PID_OUT_MAX / 2)
+
+void pid_init(pid_ctrl_t *pid) {
+	pid->kp = PID_DEFAULT_KP;
+	pid->ki = PID_DEFAULT_KI;
+	pid->kd = PID_DEFAULT_KD;
+	pid->i_limit = PID_DEFAULT_ILIM;
+	pid->setpoint = 0;
+	pid->integ = 0;
+	pid->last = 0;
+}
+
+void pid_set_param(pid_ctrl_t *pid, uint8_t param, int16_t value) {
+	switch (param) {
+	case PID_PARAM_KP:
+		pid->kp = value;
+		break;
+	case PID_PARAM_KI:
+		pid->ki = value;
+		break;
+	case PID_PARAM_KD:
+		pid->kd = value;
+		break;
+	case PID_PARAM_ILIM:
+		pid->i_limit = value;
+		if (pid->integ > ((int32_t) value << PID_SHIFT))
+			pid->integ = (int32_t) value << PID_SHIFT;
+		break;
+	default:
+		break;
+	}
+}
+
+int16_t pid_get_param(const pid_ctrl_t *pid, uint8_t param) {
+	switch (param) {
+	case PID_PARAM_KP:
+		return pid->kp;
+	case PID_PARAM_KI:
+		return pid->ki;
+	case PID_PARAM_KD:
+		return pid->kd;
+	default:
+		return pid->i_limit;
+	}
+}
+
+/*! \brief Change the setpoint.
+ * The integral term is kept, the derivative memory is loaded with the
+ * current measurement so there is no kick on the first update.
+ */
+void pid_set_setpoint(pid_ctrl_t *pid, uint16_t setpoint, uint16_t measurement) {
+	if (!pid->setpoint)
+		pid->integ = 0;
+	pid->setpoint = setpoint;
+	pid->last = measurement;
+}
+
+/*! \brief One controller step.
+ * Returns the new duty (0 .. PID_DUTY_MAX). The derivative acts on the
+ * measurement only. The integral stops while the output is saturated
+ * in the direction of the error (conditional integration) and is clamped
+ * to 0 .. i_limit.
+ */
+uint16_t pid_update(pid_ctrl_t *pid, uint16_t measurement) {
+	int16_t err;
+	int32_t out, ilim;
+
+	if (!pid->setpoint)
+		return 0;
+
+	err = (int16_t) (pid->setpoint - measurement);
+	out = (int32_t) pid->kp * err;
+	out -= (int32_t) pid->kd * (int16_t) (measurement - pid->last);
+	pid->last = measurement;
+
+	if (!((out + pid->integ >= ((int32_t) PID_OUT_MAX << PID_SHIFT) && err > 0)
+			|| (out + pid->integ <= 0 && err < 0))) {
+		pid->integ += (int32_t) pid->ki * err;
+		ilim = (int32_t) pid->i_limit << PID_SHIFT;
+		if (pid->integ > ilim)
+			pid->integ = ilim;
+		else if (pid->integ < 0)
+			pid->integ = 0;
+	}
+
+	out = (out + pid->integ) >> (PID_SHIFT - PID_FRAC);
+	if (out < 0)
+		return 0;
+	if (out > PID_DUTY_MAX)
+		return PID_DUTY_MAX;
+	return out;
+}
@@ -0,0 +1,45 @@
+/*
+ * pid.h
+ *
+ * Fixed-point PID controller for the heater outputs.
+ * Measurement and setpoint use the same units as the published
+ * temperature words, the output is a 16 bit heater duty: Timer1 compare
+ * value (0 .. PID_OUT_MAX) << PID_FRAC plus PID_FRAC fraction bits.
+ */
+
+#ifndef PID_H_
+#define PID_H_
+
+#include <stdint.h>
+
+// gains are Q8.8 fixed point: 0x0100 == 1.0
+#define PID_SHIFT   8
+
+// top of Timer1 (ICR1), largest duty the controller will output
+#define PID_OUT_MAX 0x0FFF
+#define PID_FRAC    4
+#define PID_DUTY_MAX ((PID_OUT_MAX << PID_FRAC) | ((1 << PID_FRAC) - 1))
+
+// parameter index for pid_set_param()
+#define PID_PARAM_KP   0
+#define PID_PARAM_KI   1
+#define PID_PARAM_KD   2
+#define PID_PARAM_ILIM 3
+
+typedef struct {
+	int16_t kp;			// proportional gain (Q8.8)
+	int16_t ki;			// integral gain per update (Q8.8)
+	int16_t kd;			// derivative gain per update (Q8.8)
+	int16_t i_limit;	// anti-windup: integral term is clamped to 0 .. i_limit (duty counts)
+	uint16_t setpoint;	// 0: controller off
+	int32_t integ;		// integral term, scaled by 1 << PID_SHIFT
+	uint16_t last;		// previous measurement for the derivative term
+} pid_ctrl_t;
+
+void pid_init(pid_ctrl_t *pid);
+void pid_set_param(pid_ctrl_t *pid, uint8_t param, int16_t value);
+int16_t pid_get_param(const pid_ctrl_t *pid, uint8_t param);
+void pid_set_setpoint(pid_ctrl_t *pid, uint16_t setpoint, uint16_t measurement);
+uint16_t pid_update(pid_ctrl_t *pid, uint16_t measurement);
+
+#endif /* PID_H_ */
@@ -0,0 +1,322 @@
+/*
+ * registers.h
+ *
+ * TWI register map. The master writes a register pointer, then reads or
+ * writes any number of consecutive registers in the same transaction
+ * (24Cxx style, the pointer auto-increments and wraps at TWI_TX_BUFFER_SIZE).
+ * 16 bit registers are little endian. They take effect when their high
+ * byte is written, so write both bytes in one burst.
+ */
+
+#ifndef REGISTERS_H_
+#define REGISTERS_H_
+
+/* build options, for the compiler (-D)
+ * The application does not fit below BOOT_START with every feature, these
+ * are left out unless defined. Their registers read 0 and ignore writes
+ * then. The sim build (sim/Makefile) turns all of them on.
+ *  OFEN_TUNE     relay auto-tune, REG_TUNE*
+ *  OFEN_PROFILE  ramp/soak profiles, REG_PROF*
+ *  OFEN_JOURNAL  state journal and resume after a reset, journal.c
+ *  OFEN_FAN_CTL  fan speed control, REG_RPM_SET (the tach is always there)
+ *  OFEN_ALERT    alert line on PB0, REG_ALERT*
+ *  OFEN_DITHER   REG_POWER_DITHER, the bit is ignored without it
+ *  OFEN_PEAK     power budget, REG_PEAK and REG_RATING_*
+ *  OFEN_FILTER   REG_FILTER_*, without it they read the fixed 64 sample mean
+ *                (ADC_FILTER_DEFAULT in main.c), no median, no iir
+ */
+
+#define REG_STATUS    0x00 // ro  REG_STATUS_* bits
+#define REG_FAN       0x01 // rw  fan duty (OCR0A), writing it ends speed control
+#define REG_TEMP_OH   0x02 // ro  16 bit raw, filtered adc counts * 16
+#define REG_TEMP_UH   0x04 // ro  16 bit raw
+#define REG_SET_OH    0x06 // rw  16 bit setpoint in REG_DEG units, 0 = PID off
+#define REG_SET_UH    0x08 // rw  16 bit
+#define REG_DUTY_OH   0x0A // rw  16 bit heater duty, writing it switches the PID off
+#define REG_DUTY_UH   0x0C // rw  16 bit
+#define REG_HIST_COUNT 0x0E // ro  complete entries in the history fifo
+#define REG_HIST_DATA 0x0F // ro  fifo port, see below
+#define REG_PID_OH    0x10 // rw  4 x 16 bit: kp, ki, kd, i_limit (PID_PARAM_* order)
+#define REG_PID_UH    0x18 // rw  4 x 16 bit
+#define REG_POWER     0x20 // rw  REG_POWER_* bits
+#define REG_PEAK      0x21 // rw  peak power budget, 0 = unlimited
+#define REG_RATING_OH 0x22 // rw  heater power, same unit as REG_PEAK
+#define REG_RATING_UH 0x23 // rw
+#define REG_FILTER_OH 0x24 // rw  ADC_FILTER_* config
+#define REG_FILTER_UH 0x25 // rw
+#define REG_ADDRESS   0x26 // rw  own slave address 0x08 .. 0x77, eeprom
+#define REG_GROUP     0x27 // rw  group mask for general call frames, eeprom
+#define REG_DEG_OH    0x28 // ro  16 bit signed temperature, 1/16 deg C
+#define REG_DEG_UH    0x2A // ro  16 bit
+#define REG_TRIM_OH   0x2C // rw  2 x 16 bit: offset (1/16 deg C), gain (0x8000 = 1.0), eeprom
+#define REG_TRIM_UH   0x30 // rw  2 x 16 bit
+#define REG_PROF      0x34 // rw  write PROF_CMD_*, read PROF_* state
+#define REG_PROF_STEP 0x35 // ro  current segment
+#define REG_PROF_TIME 0x36 // ro  16 bit, seconds left in the current ramp or soak
+#define REG_PROF_PTR  0x38 // rw  offset into the profile image
+#define REG_PROF_DATA 0x39 // rw  profile image port, see below
+#define REG_FAULT     0x3A // rw  latched FAULT_* code, any write clears it
+#define REG_TIMEOUT   0x3B // rw  seconds of heating without a register write before a trip, 0 = off
+#define REG_RPM       0x3C // ro  16 bit fan speed, updated once per second
+#define REG_RPM_SET   0x3E // rw  16 bit target fan speed, 0 = open loop (REG_FAN)
+#define REG_ALERT     0x40 // rw  ALERT_* enable bits for the alert line
+#define REG_ALERT_SRC 0x41 // ro  ALERT_* conditions driving the line now
+#define REG_ALERT_HI  0x42 // rw  16 bit signed, REG_DEG units: ALERT_HIGH above
+#define REG_ALERT_LO  0x44 // rw  16 bit signed: ALERT_LOW below
+#define REG_TUNE_SET  0x46 // rw  16 bit relay switching point, REG_DEG units
+#define REG_TUNE_DUTY 0x48 // rw  relay on duty, high byte of REG_DUTY_*
+#define REG_TUNE      0x49 // rw  write TUNE_CMD_*, read TUNE_* state
+#define REG_TUNE_TU   0x4A // ro  16 bit oscillation period, samples of the channel
+#define REG_TUNE_AMP  0x4C // ro  16 bit peak to peak amplitude, REG_DEG units
+#define REG_RX_DROPPED 0x4E // ro  write frames NACKed and lost to a full receive queue, wraps
+#define REG_TASK_OVERRUN 0x4F // ro  periodic tasks started after their deadline, wraps
+#define REG_BOOT      0x50 // wo  BOOT_MAGIC starts the bootloader, see boot.h
+#define REG_FILE_END  0x51
+#define REG_SNAP      0x74 // ro  snapshot window up to 0x7F, see below
+
+/* diagnostics block, only with TWI_DIAG (USI_TWI_Slave.h), reads 0xFF
+ * otherwise. Counters wrap, the master looks at differences. Maxima are
+ * isr run times in Timer0 ticks of 8 cpu cycles, without prologue and
+ * epilogue, updated once per sample.
+ */
+#define REG_DIAG_FRAMES      0x52 // ro  16 bit, write frames processed
+#define REG_DIAG_RX_OVERFLOW 0x54 // ro  frames longer than TWI_RX_BUFFER_SIZE, NACKed and dropped
+#define REG_DIAG_ABORTED     0x55 // ro  start conditions in the middle of a byte
+#define REG_DIAG_MAX_START   0x56 // ro  USI start condition isr
+#define REG_DIAG_MAX_OVF     0x57 // ro  USI overflow isr, 0 with USI_TWI_FAST_ISR
+#define REG_DIAG_MAX_T0      0x58 // ro  TIM0_OVF isr
+#define REG_DIAG_MAX_ADC     0x59 // ro  ADC isr
+#define REG_DIAG_MAX_TASK    0x5A // ro  periodic task in main (not an isr), see REG_TASK_OVERRUN
+#define REG_DIAG_END         0x5C
+
+/* REG_TASK_OVERRUN
+ * Periodic work (safety checks, fan control, profile) runs from a task
+ * table in main.c on timer0 ticks of 1.25 ms. Every task has a period and
+ * a deadline, each start later than its deadline counts here. Write
+ * frames and samples are handled on every pass of the main loop.
+ */
+
+/* REG_DUTY_*
+ * Fraction of the timer1 period, 0xFFFF = full power. The upper 12 bits
+ * are the compare value, the lower 4 bits are dropped unless
+ * REG_POWER_DITHER is set (and built, OFEN_DITHER).
+ */
+
+/* REG_RPM, REG_RPM_SET
+ * The fan tach (open collector, FAN_PPR pulses per turn) goes to PB1.
+ * Pulses are counted over one second, so REG_RPM moves in steps of
+ * 60 / FAN_PPR. With a target set, REG_FAN is trimmed once per second
+ * towards it, but not below FAN_DUTY_MIN. Writing REG_FAN or starting a
+ * profile segment returns to open loop, REG_RPM_SET reads 0 then. Speed
+ * control only with OFEN_FAN_CTL.
+ * REG_STATUS_STALL: the fan was driven for a whole second without a
+ * pulse.
+ */
+
+/* REG_ALERT, alert line
+ * PB0 is an open drain output, wire-or it with the other ovens and pull
+ * it up at the master. The line is low while REG_ALERT_SRC is not 0,
+ * i.e. while an enabled condition holds:
+ *  ALERT_READY  a new sample was published, cleared by the next read of
+ *               this oven (any register, typically the snapshot)
+ *  ALERT_FAULT  REG_STATUS_FAULT or REG_STATUS_STALL
+ *  ALERT_HIGH   a temperature above REG_ALERT_HI
+ *  ALERT_LOW    a temperature below REG_ALERT_LO
+ * The level conditions stay until the cause is gone. On a shared line the
+ * master finds the oven by its REG_ALERT_SRC or snapshot status. Only
+ * with OFEN_ALERT, PB0 stays an input without it.
+ */
+#define ALERT_READY 0
+#define ALERT_FAULT 1
+#define ALERT_HIGH  2
+#define ALERT_LOW   3
+
+/* write frames, REG_RX_DROPPED
+ * Write frames are queued in the USI driver (TWI_RX_QUEUE_SIZE bytes, one
+ * more per frame), so a master may send several back to back. When the
+ * queue is full the frame is NACKed at the first byte that does not fit,
+ * nothing of it is applied and REG_RX_DROPPED counts it: send it again.
+ * Setting the register pointer for a read is never refused.
+ */
+
+/* REG_BOOT, firmware update
+ * Writing BOOT_MAGIC switches the heaters off and jumps to the bootloader
+ * at BOOT_START, which keeps the slave address. Other values are ignored,
+ * the register reads 0. A group frame starts it on several ovens. From
+ * then on the oven talks the protocol of boot.h until the master starts
+ * the application again.
+ */
+
+/* journal, resume after a reset
+ * Setpoints, duties, the fan, REG_TIMEOUT and a running profile go into
+ * a ring of records in eeprom (journal.c) when they change, at most once
+ * a minute, so the last minute of changes may be lost. A running profile
+ * refreshes its setpoints and REG_PROF_TIME once a minute. After
+ * a reset or a power loss the chip starts from the newest complete record
+ * before the first sample and sets REG_STATUS_RESUMED. A soak may run up
+ * to a minute longer than programmed. After a watchdog reset
+ * (FAULT_RESET) the heaters and the profile stay off, the fan and
+ * REG_TIMEOUT come back. A record cut short by the reset is dropped.
+ * Fuse the brown-out detector on, below its level eeprom writes and the
+ * cpu itself are not reliable. Only with OFEN_JOURNAL, without it every
+ * reset starts from idle.
+ */
+
+/* general call
+ * A write to address 0 is a group frame: [group mask, register pointer,
+ * data ...]. Every oven whose REG_GROUP shares a bit with the mask applies
+ * it like a normal write frame, GROUP_ALL addresses all ovens. REG_ADDRESS
+ * can't be written this way. The I2C spec reserves a second byte of 0,
+ * frames with mask 0 are ignored. Masks 0x04 and 0x06 are general call
+ * commands there too, avoid them if other devices share the bus.
+ */
+#define GROUP_ALL 0xFF // whatever REG_GROUP holds
+
+/* snapshot, published once per sample (each channel is a sample of its own)
+ *  [seq | status | temp oh lo | hi | temp uh lo | hi | duty oh lo | hi
+ *   | duty uh lo | hi | fan | pec]
+ * A read latches the latest snapshot, so one burst from REG_SNAP is
+ * consistent. Temperatures in REG_DEG units. seq is the low byte of the sample counter (see the history
+ * fifo), pec is the SMBus CRC-8 (x^8 + x^2 + x + 1) over address + W,
+ * REG_SNAP, address + R and the 11 data bytes, i.e. what the master sees
+ * for a read starting at REG_SNAP.
+ */
+#define SNAP_SEQ     0
+#define SNAP_STATUS  1
+#define SNAP_TEMP_OH 2
+#define SNAP_TEMP_UH 4
+#define SNAP_DUTY_OH 6
+#define SNAP_DUTY_UH 8
+#define SNAP_FAN     10
+#define SNAP_PEC     11
+
+/* ramp/soak profile
+ * Up to PROF_SEGS segments in eeprom, run once per second. Each segment
+ * ramps the setpoint of both heaters from where it is to target at rate,
+ * then holds it for hold seconds. The fan duty is set when the segment
+ * starts. Start begins with segment 0 at the current temperature, writing
+ * a setpoint or duty by hand aborts the profile.
+ * The image is written through the port: [REG_PROF_PTR, offset, data ...],
+ * the pointer advances with every data byte. REG_PROF_DATA reads the byte
+ * at the pointer. Writes are ignored while a profile runs.
+ *  image:   [segment count | segments ...]
+ *  segment: [target lo | hi | rate lo | hi | hold lo | hi | fan]
+ * target in REG_DEG units, rate in REG_DEG units per minute (0 = jump),
+ * hold in seconds. Only with OFEN_PROFILE.
+ */
+#define PROF_SEGS       16
+#define PROF_SEG_SIZE   7
+#define PROF_IMAGE_SIZE (1 + PROF_SEGS * PROF_SEG_SIZE)
+#define PROF_SEG_TARGET 0
+#define PROF_SEG_RATE   2
+#define PROF_SEG_HOLD   4
+#define PROF_SEG_FAN    6
+
+// REG_PROF commands
+#define PROF_CMD_START  1
+#define PROF_CMD_PAUSE  2
+#define PROF_CMD_RESUME 3
+#define PROF_CMD_ABORT  4
+
+// REG_PROF state
+#define PROF_IDLE       0
+#define PROF_RAMP       1
+#define PROF_SOAK       2
+#define PROF_DONE       3
+#define PROF_PAUSED     0x80 // with PROF_RAMP or PROF_SOAK
+
+/* auto-tune, relay feedback
+ * Write [REG_TUNE_SET, set lo | hi | duty | TUNE_CMD_START | ch << TUNE_CH]
+ * in one frame. The channel's controller goes off and the heater switches
+ * between duty and 0 whenever the temperature crosses REG_TUNE_SET
+ * +- TUNE_HYST. The first cycle (heating up) is not measured, the next
+ * TUNE_CYCLES give the mean period REG_TUNE_TU and amplitude REG_TUNE_AMP
+ * (running sums until then).
+ * From these the chip computes PI gains (Tyreus-Luyben), loads them into
+ * REG_PID_* and eeprom and switches the heater off: TUNE_DONE. Writing a
+ * setpoint or duty, a profile start or a fault ends the run, so does
+ * 0xFFFF samples (3 hours) without a result: TUNE_FAIL. The other channel
+ * keeps running as it was. TUNE_HYST and TUNE_CYCLES are in main.c.
+ * Only with OFEN_TUNE.
+ * REG_PID_* live in eeprom, an erased word (0xFFFF) keeps the default.
+ */
+#define TUNE_CH        4
+#define TUNE_CMD_START 1
+#define TUNE_CMD_ABORT 2
+#define TUNE_IDLE      0
+#define TUNE_RUN       1
+#define TUNE_DONE      2
+#define TUNE_FAIL      3
+
+/* history fifo entry, HIST_ENTRY_SIZE bytes
+ *  [seq lo | seq hi | temp oh lo | temp oh hi | temp uh lo | temp uh hi]
+ * temperatures in REG_DEG units.
+ * seq counts published samples, two per channel cycle, so it doubles as
+ * a timestamp. Read
+ * REG_HIST_COUNT and keep reading: the pointer stays on REG_HIST_DATA.
+ * The fifo holds 8 entries (TWI_FIFO_SIZE), one every HIST_DIV samples
+ * (main.c), about one per second with the default filter. A master that
+ * reads less often than every 8 s loses the oldest ones. A larger
+ * HIST_DIV reaches further back, but coarser.
+ */
+#define HIST_ENTRY_SIZE 6
+
+/* REG_FAULT
+ *  [bit 4: untere hitze | bit 0-3: FAULT_* cause]
+ * The first trip latches. Both heaters go off at once (OC1B disconnected,
+ * PA7 high), setpoints, duties and a running profile are cleared, the fan
+ * keeps running. While latched, new setpoints and duties are ignored.
+ * Clearing re-arms the checks, a lasting cause trips again. Limits are
+ * the SAFE_* constants in main.c.
+ */
+#define FAULT_OPEN     1 // conversions at the top rail: sensor open, isr
+#define FAULT_OVERTEMP 2 // above SAFE_TEMP_MAX
+#define FAULT_RISE     3 // jumped more than SAFE_JUMP between two samples
+#define FAULT_STUCK    4 // no rise after SAFE_STUCK_S at more than half power
+#define FAULT_TIMEOUT  5 // REG_TIMEOUT ran out
+#define FAULT_WATCHDOG 6 // main loop stalled, heaters cut by the watchdog interrupt
+#define FAULT_RESET    7 // the watchdog reset the chip
+#define FAULT_CH       4
+
+// REG_STATUS
+#define REG_STATUS_PID_OH 0
+#define REG_STATUS_PID_UH 1
+#define REG_STATUS_LIMIT  2 // duties scaled down to meet REG_PEAK
+#define REG_STATUS_FAULT  3 // REG_FAULT latched
+#define REG_STATUS_STALL  4 // fan driven, no tach pulses
+#define REG_STATUS_RESUMED 5 // state restored from the journal, cleared by the next write frame
+
+/* REG_POWER
+ * Both heaters are on from the start of the timer1 period by default.
+ * Staggered, the lower heater goes on when the upper one goes off, so
+ * their on-windows only overlap if the duties add up to more than one
+ * period. If REG_RATING_OH + REG_RATING_UH exceeds REG_PEAK the heaters
+ * are always staggered and both duties are scaled down to share one
+ * period. On top of that the mean power, rating * duty summed over both,
+ * is scaled down to REG_PEAK, which also holds back a single heater rated
+ * above it (REG_STATUS_LIMIT either way). REG_DUTY_* read back the scaled
+ * values. The budget only with OFEN_PEAK.
+ * Dithered, the compare value alternates between its two neighbours
+ * from period to period so that the mean over 16 periods has the full
+ * 16 bit resolution of REG_DUTY_*. Only with OFEN_DITHER.
+ */
+#define REG_POWER_STAGGER 0
+#define REG_POWER_DITHER  1
+
+#if REG_HIST_DATA != TWI_FIFO_PORT || TWI_FIFO_SIZE % HIST_ENTRY_SIZE
+#error history fifo does not match the USI driver
+#endif
+
+#if REG_FILE_END > TWI_REG_FILE_SIZE
+#error TWI register map does not fit into the TX buffer
+#endif
+
+#if defined(TWI_DIAG) && REG_DIAG_END > TWI_REG_FILE_SIZE
+#error TWI diagnostics block does not fit into the TX buffer
+#endif
+
+#if REG_SNAP != TWI_SNAP_BASE || SNAP_PEC + 1 != TWI_SNAP_SIZE
+#error snapshot does not match the USI driver
+#endif
+
+#endif /* REGISTERS_H_ */
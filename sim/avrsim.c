@@ -0,0 +1,533 @@
+/*
+ * avrsim.c
+ *
+ * ATtiny84 model, see avrsim.h. The registers are the variables the
+ * firmware sees through sim/shim/avr/io.h. Plain registers are read by
+ * the model whenever it syncs: after every isr, when the firmware goes to
+ * sleep and on every access to PINA, TIFR1 and USISR.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/power.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include "avrsim.h"
+#include "plant.h"
+
+volatile uint8_t PORTA, DDRA, PORTB, DDRB, PINB;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK0;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+volatile uint16_t TCNT1, ICR1, OCR1A, OCR1B;
+volatile uint8_t ACSR, ADCSRA, ADCSRB, ADMUX, DIDR0;
+volatile uint16_t ADCW;
+volatile uint8_t USICR, USIDR;
+volatile uint8_t GPIOR0, GPIOR1, GPIOR2;
+volatile uint8_t MCUSR = 1 << PORF, WDTCSR, GIMSK, PCMSK0, PCMSK1;
+volatile uint8_t sim_sreg_i;
+
+// vectors of main.c and USI_TWI_Slave.c
+void PCINT1_vect(void);
+void WDT_vect(void);
+void TIM1_COMPA_vect(void);
+void TIM1_COMPB_vect(void);
+void TIM1_OVF_vect(void);
+void TIM0_OVF_vect(void);
+void ADC_vect(void);
+void USI_START_vect(void);
+void USI_OVF_vect(void);
+
+#define SCL (1 << PA4)
+#define SDA (1 << PA6)
+#define FAN_PPR 2
+#define WDT_HZ 128000
+#define FW_STACK 0x10000
+
+static uint64_t now;
+static uint8_t clkDiv = 1 << clock_div_8;	// CKDIV8 fuse
+static uint8_t sleepMode, sleepEn, frozen;
+
+// write one to clear registers, read through the slots
+static uint8_t tifr1, tifr1Slot = 0x80, usisr, usisrSlot, pina;
+static uint8_t tov0, adif, wdif, pcif1;
+
+static uint64_t t0Acc, t1Acc;		// cycles into the current timer count
+static uint16_t ocr1aL, ocr1bL;		// compare registers, latched at BOTTOM
+static uint64_t adcEnd;				// 0: no conversion
+static uint64_t wdtEnd;				// 0: watchdog off
+static double tachPhase;			// to the next tach edge, 0 .. 1
+static uint8_t tachPin = 1;
+
+// bus: master drive and line levels
+static uint8_t mScl = 1, mSda = 1, sclLine = 1, sdaLine = 1, usiOut = 1;
+
+static uint64_t heatOn[2], heatSpan;
+
+static ucontext_t fwCtx, masterCtx;
+static uint64_t masterWake;
+
+uint64_t sim_now(void) {
+	return now;
+}
+
+double sim_seconds(void) {
+	return (double) now / SIM_F_OSC;
+}
+
+uint64_t sim_ns_to_cyc(uint64_t ns) {
+	return (ns * (SIM_F_OSC / 200) + 4999999) / 5000000;
+}
+
+/*! \brief Bus lines after a change on either side.
+ * SDA changes are handled before SCL, the slave only moves SDA while it
+ * holds SCL low. Runs until nothing changes any more, a counter overflow
+ * on the SCL edge holds the line again.
+ */
+static void bus_update(void) {
+	uint8_t twi = (USICR & ((1 << USIWM1) | (1 << USICS1))) == ((1 << USIWM1) | (1 << USICS1));
+	uint8_t sda, scl, hold;
+
+	for (;;) {
+		if (!sclLine)
+			usiOut = USIDR >> 7; // output latch is open while SCL is low
+		sda = mSda && !((DDRA & SDA) && (!(PORTA & SDA) || (twi && !usiOut)));
+		if (sda != sdaLine) {
+			sdaLine = sda;
+			if (sclLine && (USICR & (1 << USIWM1)))
+				usisr |= sda ? 1 << USIPF : 1 << USISIF;
+			continue;
+		}
+
+		hold = (USICR & (1 << USIWM1)) && ((usisr & (1 << USISIF))
+				|| ((USICR & (1 << USIWM0)) && (usisr & (1 << USIOIF))));
+		scl = mScl && !(!sclLine && hold) && !((DDRA & SCL) && !(PORTA & SCL));
+		if (scl == sclLine)
+			break;
+		sclLine = scl;
+		if (!twi)
+			continue;
+		if (scl) {
+			usiOut = USIDR >> 7;
+			USIDR = USIDR << 1 | sdaLine;
+		}
+		if (((usisr + 1) & 0x0F) == 0)
+			usisr |= 1 << USIOIF;
+		usisr = (usisr & 0xF0) | ((usisr + 1) & 0x0F);
+	}
+	pina = (PORTA & ~(SCL | SDA)) | (sclLine ? SCL : 0) | (sdaLine ? SDA : 0);
+}
+
+// pick up register writes done by the firmware since the last sync
+static void sync(void) {
+	if (!(tifr1Slot & 0x80)) // bit 7 is not implemented, it went away with a write
+		tifr1 &= ~tifr1Slot;
+	tifr1Slot = tifr1 | 0x80;
+	if (usisrSlot & (1 << USIDC)) { // USIDC reads 0, the firmware writes it as 1
+		usisr = (usisr & 0xE0 & ~usisrSlot) | (usisrSlot & 0x0F);
+		usisrSlot = usisr;
+	}
+	if (ADCSRA & (1 << ADIF)) {
+		adif = 0;
+		ADCSRA &= ~(1 << ADIF);
+	}
+	bus_update();
+}
+
+volatile uint8_t *sim_pina(void) {
+	sync();
+	return &pina;
+}
+
+volatile uint8_t *sim_tifr1(void) {
+	sync();
+	return &tifr1Slot;
+}
+
+volatile uint8_t *sim_usisr(void) {
+	sync();
+	usisrSlot = usisr;
+	return &usisrSlot;
+}
+
+// the timer prescalers keep their position
+void clock_prescale_set(clock_div_t div) {
+	t0Acc = (t0Acc << div) / clkDiv;
+	t1Acc = (t1Acc << div) / clkDiv;
+	clkDiv = 1 << div;
+}
+
+void set_sleep_mode(uint8_t mode) {
+	sleepMode = mode;
+}
+
+void sleep_enable(void) {
+	sleepEn = 1;
+}
+
+void sleep_disable(void) {
+	sleepEn = 0;
+}
+
+static uint64_t wdt_period(void) {
+	uint8_t p = (WDTCSR & 7) | (WDTCSR & (1 << WDP3) ? 8 : 0);
+
+	return (SIM_F_OSC << (11 + p)) / WDT_HZ;
+}
+
+void sim_boot_entry(void) {
+	fprintf(stderr, "#%.3f: bootloader started, not simulated\n", sim_seconds());
+	exit(3);
+}
+
+void wdt_enable(uint8_t timeout) {
+	WDTCSR = (1 << WDE) | (timeout & 7) | (timeout & 8 ? 1 << WDP3 : 0);
+	wdtEnd = now + wdt_period();
+}
+
+void wdt_disable(void) {
+	WDTCSR = 0;
+	wdtEnd = 0;
+}
+
+void wdt_reset(void) {
+	if (wdtEnd)
+		wdtEnd = now + wdt_period();
+}
+
+/*! \brief Interrupts
+ * Highest priority first, one isr per call. Returns 1 if one ran.
+ */
+static uint8_t dispatch(void) {
+	void (*isr)(void) = 0;
+
+	sync();
+	if (!sim_sreg_i)
+		return 0;
+	if (pcif1 && (GIMSK & (1 << PCIE1))) {
+		pcif1 = 0;
+		isr = PCINT1_vect;
+	} else if (wdif && (WDTCSR & (1 << WDIE))) {
+		wdif = 0;
+		WDTCSR &= ~(1 << WDIE);
+		isr = WDT_vect;
+	} else if (tifr1 & TIMSK1 & (1 << OCF1A)) {
+		tifr1 &= ~(1 << OCF1A);
+		isr = TIM1_COMPA_vect;
+	} else if (tifr1 & TIMSK1 & (1 << OCF1B)) {
+		tifr1 &= ~(1 << OCF1B);
+		isr = TIM1_COMPB_vect;
+	} else if (tifr1 & TIMSK1 & (1 << TOV1)) {
+		tifr1 &= ~(1 << TOV1);
+		isr = TIM1_OVF_vect;
+	} else if (tov0 && (TIMSK0 & (1 << TOIE0))) {
+		tov0 = 0;
+		isr = TIM0_OVF_vect;
+	} else if (adif && (ADCSRA & (1 << ADIE))) {
+		adif = 0;
+		isr = ADC_vect;
+	} else if ((usisr & (1 << USISIF)) && (USICR & (1 << USISIE)))
+		isr = USI_START_vect;
+	else if ((usisr & (1 << USIOIF)) && (USICR & (1 << USIOIE)))
+		isr = USI_OVF_vect;
+	if (!isr)
+		return 0;
+
+	sim_sreg_i = 0;
+	isr();
+	sim_sreg_i = 1;
+	sync();
+	return 1;
+}
+
+static uint64_t t0_period(void) {
+	return (uint64_t) 8 * clkDiv;
+}
+
+static uint64_t t1_period(void) {
+	return (uint64_t) 1024 * clkDiv;
+}
+
+static uint8_t t0_running(void) {
+	return (TCCR0B & 7) == 2 && !frozen;
+}
+
+static uint8_t t1_running(void) {
+	return (TCCR1B & 7) == 5 && !frozen;
+}
+
+// counts from TCNT1 to x, 1 .. TOP + 1
+static uint16_t t1_dist(uint16_t x) {
+	uint16_t top = ICR1;
+
+	if (x > top)
+		return top + 1;
+	return x > TCNT1 ? x - TCNT1 : top + 1 - TCNT1 + x;
+}
+
+// one timer1 count, fast pwm with TOP = ICR1
+static void t1_count(void) {
+	if (TCNT1 >= ICR1) {
+		TCNT1 = 0;
+		ocr1aL = OCR1A;
+		ocr1bL = OCR1B;
+	} else if (++TCNT1 == ICR1)
+		tifr1 |= (1 << ICF1) | (1 << TOV1);
+	if (TCNT1 == ocr1aL)
+		tifr1 |= 1 << OCF1A;
+	if (TCNT1 == ocr1bL)
+		tifr1 |= 1 << OCF1B;
+}
+
+// tach edges per second, FAN_PPR pulses per turn
+static double tach_rate(void) {
+	return plant_rpm() * FAN_PPR * 2 / 60;
+}
+
+static uint64_t next_event(void) {
+	uint64_t t = masterWake, e;
+	uint16_t d;
+
+	if (t0_running()) {
+		e = now + (256 - TCNT0) * t0_period() - t0Acc;
+		if (e < t)
+			t = e;
+	}
+	if (t1_running()) {
+		d = t1_dist(0);
+		if (t1_dist(ICR1) < d)
+			d = t1_dist(ICR1);
+		if (t1_dist(ocr1aL) < d)
+			d = t1_dist(ocr1aL);
+		if (t1_dist(ocr1bL) < d)
+			d = t1_dist(ocr1bL);
+		e = now + d * t1_period() - t1Acc;
+		if (e < t)
+			t = e;
+	}
+	if (adcEnd && adcEnd < t)
+		t = adcEnd;
+	if (wdtEnd && wdtEnd < t)
+		t = wdtEnd;
+	if (tach_rate() > 0) {
+		e = now + (uint64_t) ((1 - tachPhase) / tach_rate() * SIM_F_OSC) + 1;
+		if (e < t)
+			t = e;
+	}
+	return t;
+}
+
+static void heaters(uint8_t on[2]) {
+	uint8_t pin = PORTA & (1 << PA5);
+
+	if (TCCR1A & (1 << 5)) // COM1B1, OC1B drives PA5
+		pin = (TCNT1 < ocr1bL) == !(TCCR1A & (1 << 4));
+	on[0] = (DDRA & (1 << PA5)) && !pin;
+	on[1] = (DDRA & (1 << PA7)) && !(PORTA & (1 << PA7));
+}
+
+static double fan_drive(void) {
+	if (!(DDRB & (1 << PB2)))
+		return 0;
+	if (TCCR0A & (1 << 7)) // COM0A1, non-inverting fast pwm
+		return (OCR0A + 1) / 256.0;
+	return PORTB & (1 << PB2) ? 1 : 0;
+}
+
+// time moves on by dt cycles, events on the way were scheduled
+static void advance(uint64_t dt) {
+	uint64_t n, p;
+	uint8_t on[2], ch;
+
+	heaters(on);
+	for (ch = 0; ch < 2; ch++)
+		if (on[ch])
+			heatOn[ch] += dt;
+	heatSpan += dt;
+	tachPhase += tach_rate() * dt / SIM_F_OSC;
+	plant_step((double) dt / SIM_F_OSC, on, fan_drive());
+
+	now += dt;
+	if (t0_running()) {
+		p = t0_period();
+		t0Acc += dt;
+		n = TCNT0 + t0Acc / p;
+		t0Acc %= p;
+		if (n >= 256)
+			tov0 = 1;
+		TCNT0 = n;
+	}
+	if (t1_running()) {
+		p = t1_period();
+		t1Acc += dt;
+		for (; t1Acc >= p; t1Acc -= p)
+			t1_count();
+	}
+
+	if (adcEnd && now >= adcEnd) {
+		adcEnd = 0;
+		ADCW = plant_adc((ADMUX & 0x3F) == 0x0E);
+		ADCSRA &= ~(1 << ADSC);
+		adif = 1;
+	}
+	if (wdtEnd && now >= wdtEnd) {
+		if (!(WDTCSR & (1 << WDIE))) {
+			fprintf(stderr, "#%.3f: watchdog reset\n", sim_seconds());
+			exit(3);
+		}
+		wdif = 1;
+		wdtEnd = now + wdt_period();
+	}
+	if (tachPhase >= 1) {
+		tachPhase -= 1;
+		tachPin ^= 1;
+		PINB = (PINB & ~(1 << PB1)) | (tachPin << PB1);
+		if (PCMSK1 & (1 << PCINT9))
+			pcif1 = 1;
+	}
+}
+
+/*! \brief The world runs while the firmware sleeps.
+ * Noise reduction sleep starts a conversion and stops clkI/O, the timers
+ * stand still until an interrupt wakes the cpu.
+ */
+void sleep_cpu(void) {
+	uint64_t t;
+
+	if (!sleepEn)
+		return;
+	sync();
+	// started by writing ADSC, clkI/O keeps running (13 adc clocks)
+	if ((ADCSRA & (1 << ADEN)) && (ADCSRA & (1 << ADSC)) && !adcEnd)
+		adcEnd = now + 26 * 16 * clkDiv;
+	if (sleepMode == SLEEP_MODE_ADC && (ADCSRA & (1 << ADEN)) && !(ADCSRA & (1 << ADSC))) {
+		ADCSRA |= 1 << ADSC;
+		adcEnd = now + 27 * 16 * clkDiv; // 13.5 adc clocks at clk/32
+		frozen = 1;
+	}
+	for (;;) {
+		if (dispatch())
+			break;
+		if (now >= masterWake) {
+			swapcontext(&fwCtx, &masterCtx);
+			continue;
+		}
+		t = next_event();
+		if (t > now)
+			advance(t - now);
+	}
+	frozen = 0;
+}
+
+uint8_t sim_alert(void) {
+	return (DDRB & (1 << PB0)) && !(PORTB & (1 << PB0));
+}
+
+void sim_heat_stats(double on[2]) {
+	uint8_t ch;
+
+	for (ch = 0; ch < 2; ch++) {
+		on[ch] = heatSpan ? (double) heatOn[ch] / heatSpan : 0;
+		heatOn[ch] = 0;
+	}
+	heatSpan = 0;
+}
+
+void sim_bus_drive(uint8_t scl, uint8_t sda) {
+	mScl = scl;
+	mSda = sda;
+	sync();
+}
+
+uint8_t sim_bus_scl(void) {
+	return sclLine;
+}
+
+uint8_t sim_bus_sda(void) {
+	return sdaLine;
+}
+
+static void fw_entry(void) {
+	fw_main();
+	fprintf(stderr, "firmware returned\n");
+	exit(3);
+}
+
+void sim_init(void) {
+	static uint8_t stack[FW_STACK];
+
+	getcontext(&fwCtx);
+	fwCtx.uc_stack.ss_sp = stack;
+	fwCtx.uc_stack.ss_size = sizeof(stack);
+	fwCtx.uc_link = 0;
+	makecontext(&fwCtx, fw_entry, 0);
+	PINB = 0x0F;
+	sim_run_until(0); // boot up to the first sleep
+}
+
+void sim_run_until(uint64_t t) {
+	masterWake = t;
+	swapcontext(&masterCtx, &fwCtx);
+}
+
+// eeprom, EEMEM puts the variables into this section
+extern uint8_t __start_sim_eeprom[], __stop_sim_eeprom[];
+
+#define EE_SIZE ((size_t) (__stop_sim_eeprom - __start_sim_eeprom))
+
+void sim_eeprom_erase(void) {
+	memset(__start_sim_eeprom, 0xFF, EE_SIZE);
+}
+
+int sim_eeprom_load(const char *path) {
+	FILE *f = fopen(path, "rb");
+	size_t n;
+
+	if (!f)
+		return -errno;
+	n = fread(__start_sim_eeprom, 1, EE_SIZE, f);
+	fclose(f);
+	return n == EE_SIZE ? 0 : -EINVAL;
+}
+
+int sim_eeprom_save(const char *path) {
+	FILE *f = fopen(path, "wb");
+	size_t n;
+
+	if (!f)
+		return -errno;
+	n = fwrite(__start_sim_eeprom, 1, EE_SIZE, f);
+	return fclose(f) || n != EE_SIZE ? -EIO : 0;
+}
+
+uint8_t eeprom_read_byte(const uint8_t *p) {
+	return *p;
+}
+
+uint16_t eeprom_read_word(const uint16_t *p) {
+	uint16_t v;
+
+	memcpy(&v, p, 2);
+	return v;
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n) {
+	memcpy(dst, src, n);
+}
+
+void eeprom_update_byte(uint8_t *p, uint8_t value) {
+	*p = value;
+}
+
+void eeprom_update_word(uint16_t *p, uint16_t value) {
+	memcpy(p, &value, 2);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n) {
+	memcpy(dst, src, n);
+}
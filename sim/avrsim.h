@@ -0,0 +1,46 @@
+/*
+ * avrsim.h
+ *
+ * Just enough ATtiny84 to run the firmware on the host: timer0, timer1
+ * with its outputs, the adc in noise reduction sleep, the watchdog, the
+ * tach input and the USI in two-wire mode, bit by bit. The firmware runs
+ * as a coroutine, simulated time passes only while it sleeps, its own
+ * code and isrs take no time. The master (script, bus_fw.c) is the other
+ * coroutine and runs while the firmware sleeps.
+ *
+ * Time is counted in oscillator cycles, SIM_F_OSC per second.
+ */
+
+#ifndef AVRSIM_H_
+#define AVRSIM_H_
+
+#include <stdint.h>
+
+#define SIM_F_OSC 3276800ULL
+
+// firmware entry, main.c built with -Dmain=fw_main
+int fw_main(void);
+
+void sim_init(void);
+uint64_t sim_now(void);
+double sim_seconds(void);
+uint64_t sim_ns_to_cyc(uint64_t ns);
+
+// master side: let the chip run up to cycle t
+void sim_run_until(uint64_t t);
+
+// bus lines driven by the master, 1 = released
+void sim_bus_drive(uint8_t scl, uint8_t sda);
+uint8_t sim_bus_scl(void);
+uint8_t sim_bus_sda(void);
+
+// outputs: alert line asserted, heater on time [0: oben, 1: unten] since the last call (0 .. 1)
+uint8_t sim_alert(void);
+void sim_heat_stats(double on[2]);
+
+// eeprom image: erased (0xFF), or the EEMEM initialisers like a flashed .eep
+void sim_eeprom_erase(void);
+int sim_eeprom_load(const char *path);
+int sim_eeprom_save(const char *path);
+
+#endif /* AVRSIM_H_ */
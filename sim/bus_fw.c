@@ -0,0 +1,151 @@
+/*
+ * bus_fw.c
+ *
+ * ofen_bus_t on the simulated chip: a bit-banged master on the USI lines
+ * of avrsim.c, clocked in simulated time. The slave may stretch SCL, the
+ * master waits for the line like a real one. A NACK ends the transfer
+ * with a stop, then the master keeps the bus idle for OFEN_RETRY_US so
+ * the retry loop in ofen.c sees the slave's time pass.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include "../host/ofen.h"
+#include "avrsim.h"
+#include "bus_fw.h"
+
+#define STRETCH_MAX_US 10000
+
+typedef struct {
+	ofen_bus_t bus;
+	uint64_t quarter;	// ns
+	uint64_t t;			// ns, master clock
+	int err;
+} bus_fw_t;
+
+// a quarter bit on the master clock, keeps up with the chip after a stretch
+static void wait(bus_fw_t *b, unsigned quarters) {
+	uint64_t now = sim_now();
+
+	b->t += quarters * b->quarter;
+	if (sim_ns_to_cyc(b->t) < now)
+		b->t = now * 1000000000ULL / SIM_F_OSC;
+	sim_run_until(sim_ns_to_cyc(b->t));
+}
+
+// release SCL and wait until the slave lets it go high
+static void scl_high(bus_fw_t *b, uint8_t sda) {
+	uint64_t end;
+
+	sim_bus_drive(1, sda);
+	wait(b, 1);
+	end = sim_now() + sim_ns_to_cyc(STRETCH_MAX_US * 1000ULL);
+	while (!sim_bus_scl()) {
+		if (sim_now() >= end) {
+			b->err = -ETIMEDOUT;
+			return;
+		}
+		sim_run_until(sim_now() + 1);
+	}
+}
+
+// from idle or as a repeated start after the acknowledge bit
+static void start(bus_fw_t *b) {
+	if (!sim_bus_scl()) {
+		sim_bus_drive(0, 1);
+		wait(b, 1);
+		scl_high(b, 1);
+		wait(b, 1);
+	}
+	sim_bus_drive(1, 0);
+	wait(b, 2);
+	sim_bus_drive(0, 0);
+	wait(b, 1);
+}
+
+static void stop(bus_fw_t *b) {
+	sim_bus_drive(0, 0);
+	wait(b, 1);
+	scl_high(b, 0);
+	wait(b, 1);
+	sim_bus_drive(1, 1);
+	wait(b, 2);
+}
+
+// one bit, returns the SDA line while SCL is high
+static uint8_t bit(bus_fw_t *b, uint8_t sda) {
+	uint8_t r;
+
+	sim_bus_drive(0, sda);
+	wait(b, 1);
+	scl_high(b, sda);
+	wait(b, 1);
+	r = sim_bus_sda();
+	sim_bus_drive(0, sda);
+	wait(b, 1);
+	return r;
+}
+
+// returns 0 on ACK
+static uint8_t put(bus_fw_t *b, uint8_t c) {
+	uint8_t i;
+
+	for (i = 0; i < 8; i++, c <<= 1)
+		bit(b, c >> 7);
+	return bit(b, 1);
+}
+
+static uint8_t get(bus_fw_t *b, uint8_t ack) {
+	uint8_t i, c = 0;
+
+	for (i = 0; i < 8; i++)
+		c = c << 1 | bit(b, 1);
+	bit(b, !ack);
+	return c;
+}
+
+static int fw_xfer(ofen_bus_t *bus, ofen_msg_t *msgs, int n) {
+	bus_fw_t *b = (bus_fw_t *) bus;
+	uint8_t rd;
+	int i, j;
+
+	b->err = 0;
+	b->t = sim_now() * 1000000000ULL / SIM_F_OSC;
+	for (i = 0; i < n && !b->err; i++) {
+		rd = msgs[i].flags & OFEN_M_RD ? 1 : 0;
+		start(b); // repeated start from the second message on
+		if (put(b, msgs[i].addr << 1 | rd)) {
+			b->err = -EIO;
+			break;
+		}
+		for (j = 0; j < msgs[i].len && !b->err; j++) {
+			if (rd)
+				msgs[i].buf[j] = get(b, j < msgs[i].len - 1);
+			else if (put(b, msgs[i].buf[j]))
+				b->err = -EIO;
+		}
+		sim_bus_drive(0, 1);
+		wait(b, 1);
+	}
+	stop(b);
+	if (b->err)
+		wait(b, OFEN_RETRY_US * 1000ULL / b->quarter);
+	return b->err ? b->err : n;
+}
+
+static void fw_close(ofen_bus_t *bus) {
+	free(bus);
+}
+
+static const ofen_bus_ops_t fw_ops = { fw_xfer, fw_close };
+
+ofen_bus_t *ofen_bus_open_fw(unsigned khz) {
+	bus_fw_t *b;
+
+	if (!khz || !(b = calloc(1, sizeof(*b))))
+		return NULL;
+	b->bus.ops = &fw_ops;
+	b->bus.max_msgs = 42; // like i2c-dev
+	b->quarter = 250000 / khz;
+	return &b->bus;
+}
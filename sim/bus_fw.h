@@ -0,0 +1,14 @@
+/*
+ * bus_fw.h
+ *
+ * ofen_bus_t on the firmware running in avrsim.c, bus clock in kHz.
+ */
+
+#ifndef BUS_FW_H_
+#define BUS_FW_H_
+
+#include "../host/ofen.h"
+
+ofen_bus_t *ofen_bus_open_fw(unsigned khz);
+
+#endif /* BUS_FW_H_ */
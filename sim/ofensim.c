@@ -0,0 +1,382 @@
+/*
+ * ofensim.c
+ *
+ * The firmware on the host: main.c and the USI driver run on avrsim.c,
+ * heating plant.c, and a script plays the master over the simulated bus
+ * with the host library. Simulated time runs as fast as the host allows.
+ *
+ *   ofensim [-l log_s] [-k khz] [-a addr] [-e eeprom] [-i] [-r seed]
+ *           [-t ambient] [script]
+ *
+ * -e loads the eeprom image from the file if it exists and saves it at
+ * the end, -i starts with the EEMEM initialisers instead of an erased
+ * eeprom. The script is read from stdin without a file name.
+ *
+ * Output is csv, one line every log_s seconds while the script runs:
+ *   t, zone temperature oben/unten (model), temperature oben/unten (chip
+ *   snapshot), heater on time oben/unten since the last line, fan rpm
+ *   (model), REG_FAULT
+ * Everything else goes to lines starting with '#'. The exit status is 1
+ * if an expect or a command failed, 2 on a script error.
+ *
+ * Script, one command per line, '#' starts a comment. ch is top or bottom.
+ *   run s                   let time pass
+ *   until ch >|< degC s     run until the snapshot temperature crosses, fail after s
+ *   set ch|both degC        setpoint, 0 = off
+ *   duty ch percent         heater directly
+ *   fan duty | rpm rpm      fan drive 0 .. 255 or speed control
+ *   timeout s | clear       command timeout, clear the fault
+ *   tune ch degC [duty]     auto-tune
+ *   seg degC degC/min s fan profile segment, uploaded by the next prof start
+ *   prof start|pause|resume|abort
+ *   write reg byte ...      raw register access, numbers in C notation
+ *   read reg n
+ *   snap                    print the snapshot
+ *   open ch | close ch      sensor broken or fixed
+ *   fanfail on|off          fan blocked
+ *   ambient degC
+ *   expect what lo hi       fail unless lo <= value <= hi, what is one of
+ *                           top, bottom (snapshot deg C), zone_top, zone_bottom
+ *                           (model deg C), fault, tune, prof, rpm, alert, reg:<n>
+ *   echo text
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../host/ofen.h"
+#include "avrsim.h"
+#include "bus_fw.h"
+#include "plant.h"
+
+#define LINE_MAX_ 256
+#define ARGS_MAX  20
+
+static ofen_bus_t *bus;
+static uint8_t addr = 0x50;
+static double logInterval = 10, nextLog;
+static ofen_seg_t segs[PROF_SEGS];
+static uint8_t nSegs, segsDirty;
+static int failed;
+
+static uint64_t cycles(double s) {
+	return (uint64_t) (s * SIM_F_OSC + 0.5);
+}
+
+static void log_line(void) {
+	ofen_snap_t snap;
+	double on[2];
+	uint8_t fault = 0;
+	int r;
+
+	r = ofen_snapshot(bus, addr, &snap);
+	ofen_read(bus, addr, REG_FAULT, &fault, 1);
+	sim_heat_stats(on);
+	printf("%.1f,%.2f,%.2f,", sim_seconds(), plant_zone(0), plant_zone(1));
+	if (r < 0)
+		printf("nan,nan,");
+	else
+		printf("%.2f,%.2f,", snap.temp[0] / 16.0, snap.temp[1] / 16.0);
+	printf("%.3f,%.3f,%.0f,0x%02X\n", on[0], on[1], plant_rpm(), fault);
+}
+
+static void run(double s) {
+	double end = sim_seconds() + s;
+
+	while (logInterval > 0 && nextLog <= end) {
+		sim_run_until(cycles(nextLog));
+		log_line();
+		nextLog += logInterval;
+	}
+	sim_run_until(cycles(end));
+}
+
+static int channel(const char *s) {
+	if (!strcmp(s, "top") || !strcmp(s, "0"))
+		return 0;
+	if (!strcmp(s, "bottom") || !strcmp(s, "1"))
+		return 1;
+	if (!strcmp(s, "both"))
+		return 2;
+	return -1;
+}
+
+static int num(const char *s, long *v) {
+	char *end;
+
+	*v = strtol(s, &end, 0);
+	return *s && !*end ? 0 : -EINVAL;
+}
+
+static int16_t deg16(const char *s) {
+	return (int16_t) (atof(s) * 16);
+}
+
+static int reported(uint8_t ch, double *t) {
+	ofen_snap_t snap;
+	int r = ofen_snapshot(bus, addr, &snap);
+
+	*t = snap.temp[ch] / 16.0;
+	return r;
+}
+
+static int reg_byte(uint8_t reg, double *v) {
+	uint8_t b;
+	int r = ofen_read(bus, addr, reg, &b, 1);
+
+	*v = b;
+	return r < 0 ? r : 0;
+}
+
+static int value(const char *what, double *v) {
+	uint16_t w;
+	long reg;
+	int r;
+
+	if (!strcmp(what, "top") || !strcmp(what, "bottom"))
+		return reported(channel(what), v);
+	if (!strcmp(what, "zone_top") || !strcmp(what, "zone_bottom")) {
+		*v = plant_zone(channel(what + 5));
+		return 0;
+	}
+	if (!strcmp(what, "fault"))
+		return reg_byte(REG_FAULT, v);
+	if (!strcmp(what, "tune"))
+		return reg_byte(REG_TUNE, v);
+	if (!strcmp(what, "prof"))
+		return reg_byte(REG_PROF, v);
+	if (!strcmp(what, "alert")) {
+		*v = sim_alert();
+		return 0;
+	}
+	if (!strcmp(what, "rpm")) {
+		r = ofen_fan_rpm(bus, addr, &w);
+		*v = w;
+		return r;
+	}
+	if (!strncmp(what, "reg:", 4) && !num(what + 4, &reg) && reg >= 0 && reg < TWI_TX_BUFFER_SIZE)
+		return reg_byte(reg, v);
+	return -EINVAL;
+}
+
+static int until(uint8_t ch, char op, double t, double timeout) {
+	double end = sim_seconds() + timeout, v;
+	int r;
+
+	while (sim_seconds() < end) {
+		run(1);
+		if ((r = reported(ch, &v)) < 0)
+			return r;
+		if (op == '>' ? v > t : v < t) {
+			printf("# %.1f: reached %.2f\n", sim_seconds(), v);
+			return 0;
+		}
+	}
+	return -ETIMEDOUT;
+}
+
+static int prof_start(void) {
+	int r;
+
+	if (segsDirty) {
+		if ((r = ofen_prof_upload(bus, addr, segs, nSegs)) < 0)
+			return r;
+		segsDirty = 0;
+	}
+	return ofen_prof_cmd(bus, addr, PROF_CMD_START);
+}
+
+// one script line, returns a negative errno if the command failed, 1 on a syntax error
+static int command(int argc, char **argv) {
+	const char *cmd = argv[0];
+	uint8_t data[OFEN_WRITE_MAX];
+	ofen_snap_t snap;
+	int ch = argc > 1 ? channel(argv[1]) : -1;
+	double v;
+	long n;
+	int i, r;
+
+	if (!strcmp(cmd, "run") && argc == 2)
+		run(atof(argv[1]));
+	else if (!strcmp(cmd, "until") && argc == 5 && ch >= 0 && ch < 2
+			&& (argv[2][0] == '<' || argv[2][0] == '>'))
+		return until(ch, argv[2][0], atof(argv[3]), atof(argv[4]));
+	else if (!strcmp(cmd, "set") && argc == 3 && ch >= 0) {
+		if (ch != 1 && (r = ofen_set_setpoint(bus, addr, 0, deg16(argv[2]))) < 0)
+			return r;
+		if (ch != 0)
+			return ofen_set_setpoint(bus, addr, 1, deg16(argv[2]));
+	} else if (!strcmp(cmd, "duty") && argc == 3 && ch >= 0 && ch < 2)
+		return ofen_set_duty(bus, addr, ch, atof(argv[2]) * 0xFFFF / 100 + 0.5);
+	else if (!strcmp(cmd, "fan") && argc == 2)
+		return ofen_set_fan(bus, addr, atoi(argv[1]));
+	else if (!strcmp(cmd, "rpm") && argc == 2)
+		return ofen_set_fan_rpm(bus, addr, atoi(argv[1]));
+	else if (!strcmp(cmd, "timeout") && argc == 2)
+		return ofen_set_timeout(bus, addr, atoi(argv[1]));
+	else if (!strcmp(cmd, "clear") && argc == 1)
+		return ofen_fault_clear(bus, addr);
+	else if (!strcmp(cmd, "tune") && (argc == 3 || argc == 4) && ch >= 0 && ch < 2)
+		return ofen_tune_start(bus, addr, ch, deg16(argv[2]), argc == 4 ? atoi(argv[3]) : 0x80);
+	else if (!strcmp(cmd, "seg") && argc == 5 && nSegs < PROF_SEGS) {
+		segs[nSegs].target = deg16(argv[1]);
+		segs[nSegs].rate = deg16(argv[2]);
+		segs[nSegs].hold = atoi(argv[3]);
+		segs[nSegs].fan = atoi(argv[4]);
+		nSegs++;
+		segsDirty = 1;
+	} else if (!strcmp(cmd, "prof") && argc == 2) {
+		if (!strcmp(argv[1], "start"))
+			return prof_start();
+		if (!strcmp(argv[1], "pause"))
+			return ofen_prof_cmd(bus, addr, PROF_CMD_PAUSE);
+		if (!strcmp(argv[1], "resume"))
+			return ofen_prof_cmd(bus, addr, PROF_CMD_RESUME);
+		if (!strcmp(argv[1], "abort"))
+			return ofen_prof_cmd(bus, addr, PROF_CMD_ABORT);
+		return 1;
+	} else if (!strcmp(cmd, "write") && argc > 2 && argc - 2 <= OFEN_WRITE_MAX) {
+		for (i = 2; i < argc; i++) {
+			if (num(argv[i], &n))
+				return 1;
+			data[i - 2] = n;
+		}
+		if (num(argv[1], &n))
+			return 1;
+		return ofen_write(bus, addr, n, data, argc - 2);
+	} else if (!strcmp(cmd, "read") && argc == 3) {
+		uint8_t buf[TWI_TX_BUFFER_SIZE];
+		long len;
+
+		if (num(argv[1], &n) || num(argv[2], &len) || len < 1 || len > TWI_TX_BUFFER_SIZE)
+			return 1;
+		if ((r = ofen_read(bus, addr, n, buf, len)) < 0)
+			return r;
+		printf("# %02lX:", n);
+		for (i = 0; i < len; i++)
+			printf(" %02X", buf[i]);
+		printf("\n");
+	} else if (!strcmp(cmd, "snap") && argc == 1) {
+		if ((r = ofen_snapshot(bus, addr, &snap)) < 0)
+			return r;
+		printf("# snap seq %u status 0x%02X temp %.2f %.2f duty 0x%04X 0x%04X fan %u\n",
+				snap.seq, snap.status, snap.temp[0] / 16.0, snap.temp[1] / 16.0,
+				snap.duty[0], snap.duty[1], snap.fan);
+	} else if ((!strcmp(cmd, "open") || !strcmp(cmd, "close")) && argc == 2 && ch >= 0 && ch < 2)
+		plant_set_open(ch, cmd[0] == 'o');
+	else if (!strcmp(cmd, "fanfail") && argc == 2)
+		plant_set_fan_fail(!strcmp(argv[1], "on"));
+	else if (!strcmp(cmd, "ambient") && argc == 2)
+		plant_set_ambient(atof(argv[1]));
+	else if (!strcmp(cmd, "expect") && argc == 4) {
+		if ((r = value(argv[1], &v)) < 0)
+			return r == -EINVAL ? 1 : r;
+		i = v >= atof(argv[2]) && v <= atof(argv[3]);
+		printf("# %.1f: expect %s %s %s: %g %s\n", sim_seconds(), argv[1], argv[2], argv[3], v,
+				i ? "ok" : "FAIL");
+		failed |= !i;
+	} else if (!strcmp(cmd, "echo")) {
+		printf("#");
+		for (i = 1; i < argc; i++)
+			printf(" %s", argv[i]);
+		printf("\n");
+	} else
+		return 1;
+	return 0;
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: ofensim [-l log_s] [-k khz] [-a addr] [-e eeprom] [-i] [-r seed]"
+			" [-t ambient] [script]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	const char *eeFile = NULL;
+	unsigned khz = 100, seed = 1;
+	double ambient = 25;
+	char line[LINE_MAX_], *args[ARGS_MAX], *p;
+	struct timespec t0, t1;
+	uint8_t init = 0;
+	int c, n, lineNo = 0, r;
+	FILE *f = stdin;
+
+	while ((c = getopt(argc, argv, "l:k:a:e:ir:t:")) != -1) {
+		switch (c) {
+		case 'l':
+			logInterval = atof(optarg);
+			break;
+		case 'k':
+			khz = atoi(optarg);
+			break;
+		case 'a':
+			addr = strtol(optarg, NULL, 0);
+			break;
+		case 'e':
+			eeFile = optarg;
+			break;
+		case 'i':
+			init = 1;
+			break;
+		case 'r':
+			seed = atoi(optarg);
+			break;
+		case 't':
+			ambient = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc - 1 || !khz)
+		usage();
+	if (optind < argc && !(f = fopen(argv[optind], "r"))) {
+		perror(argv[optind]);
+		return 2;
+	}
+
+	if (!init)
+		sim_eeprom_erase();
+	if (eeFile && (r = sim_eeprom_load(eeFile)) < 0 && r != -ENOENT) {
+		fprintf(stderr, "%s: %s\n", eeFile, strerror(-r));
+		return 2;
+	}
+	plant_init(ambient, seed);
+	sim_init();
+	bus = ofen_bus_open_fw(khz);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	printf("# t,zone_oh,zone_uh,temp_oh,temp_uh,heat_oh,heat_uh,rpm,fault\n");
+	while (fgets(line, sizeof(line), f)) {
+		lineNo++;
+		if ((p = strchr(line, '#')))
+			*p = 0;
+		n = 0;
+		for (p = strtok(line, " \t\r\n"); p && n < ARGS_MAX; p = strtok(NULL, " \t\r\n"))
+			args[n++] = p;
+		if (!n)
+			continue;
+		if ((r = command(n, args)) > 0) {
+			fprintf(stderr, "line %d: syntax error\n", lineNo);
+			return 2;
+		}
+		if (r < 0) {
+			printf("# %.1f: line %d: %s: %s\n", sim_seconds(), lineNo, args[0], strerror(-r));
+			failed = 1;
+		}
+	}
+
+	run(OFEN_BUSY_MS / 1000.0); // the last frame and its eeprom writes
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("# %.1f s simulated in %.2f s\n", sim_seconds(),
+			t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	if (eeFile && (r = sim_eeprom_save(eeFile)) < 0) {
+		fprintf(stderr, "%s: %s\n", eeFile, strerror(-r));
+		return 2;
+	}
+	ofen_bus_close(bus);
+	return failed;
+}
@@ -0,0 +1,136 @@
+/*
+ * plant.c
+ *
+ * Thermal and fan model, see plant.h. Explicit Euler, plant_step()
+ * splits longer steps so the element node stays stable.
+ */
+
+#include <math.h>
+#include "plant.h"
+#include "avr/pgmspace.h"
+#include "../caltable.h"
+
+#define HEAT_W_OH  1500.0	// heater power
+#define HEAT_W_UH  1200.0
+#define C_ELEM     200.0	// J/K
+#define G_ELEM     20.0		// W/K element to zone
+#define C_ZONE     3600.0	// J/K
+#define G_AMB      2.0		// W/K zone to ambient, fan off
+#define G_FAN      1.0		// W/K more at full fan
+#define G_ZONES    2.0		// W/K between the zones
+#define TAU_SENSOR 5.0		// s
+#define NOISE_LSB  0.5		// rms, adc counts
+#define FAN_RPM    3000.0	// at full drive
+#define FAN_STALL  0.1		// drive below which it stands still
+#define TAU_FAN    1.0		// s
+#define STEP_MAX   0.1		// s
+
+static const double heatW[2] = { HEAT_W_OH, HEAT_W_UH };
+static double amb;
+static double elem[2], zone[2], sensor[2];
+static double rpm;
+static uint8_t open[2], fanFail;
+static uint64_t rng;
+
+void plant_init(double ambient, unsigned seed) {
+	uint8_t ch;
+
+	amb = ambient;
+	for (ch = 0; ch < 2; ch++) {
+		elem[ch] = zone[ch] = sensor[ch] = ambient;
+		open[ch] = 0;
+	}
+	rpm = 0;
+	fanFail = 0;
+	rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+void plant_set_ambient(double t) {
+	amb = t;
+}
+
+void plant_set_open(uint8_t ch, uint8_t o) {
+	open[ch] = o;
+}
+
+void plant_set_fan_fail(uint8_t fail) {
+	fanFail = fail;
+}
+
+static void step(double dt, const uint8_t heat[2], double fan) {
+	double gAmb = G_AMB + G_FAN * fan, target;
+	double qz[2], qe, qx = G_ZONES * (zone[0] - zone[1]);
+	uint8_t ch;
+
+	for (ch = 0; ch < 2; ch++) {
+		qe = G_ELEM * (elem[ch] - zone[ch]);
+		elem[ch] += dt * ((heat[ch] ? heatW[ch] : 0) - qe) / C_ELEM;
+		qz[ch] = qe - gAmb * (zone[ch] - amb) - (ch ? -qx : qx);
+	}
+	for (ch = 0; ch < 2; ch++) {
+		zone[ch] += dt * qz[ch] / C_ZONE;
+		sensor[ch] += (zone[ch] - sensor[ch]) * dt / TAU_SENSOR;
+	}
+
+	target = fan >= FAN_STALL && !fanFail ? FAN_RPM * fan : 0;
+	rpm += (target - rpm) * dt / TAU_FAN;
+	if (rpm < 1)
+		rpm = 0;
+}
+
+void plant_step(double dt, const uint8_t heat[2], double fan) {
+	while (dt > STEP_MAX) {
+		step(STEP_MAX, heat, fan);
+		dt -= STEP_MAX;
+	}
+	step(dt, heat, fan);
+}
+
+double plant_zone(uint8_t ch) {
+	return zone[ch];
+}
+
+double plant_rpm(void) {
+	return rpm;
+}
+
+// gaussian, Box-Muller on xorshift64
+static double noise(void) {
+	double u, v;
+
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	u = ((rng >> 11) + 1.0) / 9007199254740993.0;
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	v = (rng >> 11) / 9007199254740992.0;
+	return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+/*! \brief Conversion result for the sensor temperature.
+ * Table point i sits at i << CAL_SHIFT in REG_TEMP units, that is
+ * i << (CAL_SHIFT - 4) adc counts.
+ */
+uint16_t plant_adc(uint8_t ch) {
+	double t16 = sensor[ch] * 16, x;
+	uint8_t i;
+
+	if (open[ch])
+		return 1023;
+	if (t16 <= cal_table[0])
+		x = 0;
+	else {
+		for (i = 0; i < CAL_POINTS - 2 && t16 >= cal_table[i + 1]; i++)
+			;
+		x = i + (t16 - cal_table[i]) / (cal_table[i + 1] - cal_table[i]);
+		x *= 1 << (CAL_SHIFT - 4);
+	}
+	x = floor(x + NOISE_LSB * noise() + 0.5);
+	if (x < 0)
+		return 0;
+	if (x > 1023)
+		return 1023;
+	return x;
+}
@@ -0,0 +1,31 @@
+/*
+ * plant.h
+ *
+ * Lumped thermal model of the oven, per zone [0: oben, 1: unten]:
+ *
+ *   heater --P--> element (C_e) --G_ez--> zone air/walls (C_z) --G_za--> ambient
+ *
+ * The zones exchange heat through G_tb, the fan raises G_za. The sensor
+ * follows its zone with a first order lag and is read through the
+ * inverse of caltable.h (reference junction at 25 deg C), plus noise.
+ * The fan spins up with a lag and gives FAN_PPR tach pulses per turn.
+ */
+
+#ifndef PLANT_H_
+#define PLANT_H_
+
+#include <stdint.h>
+
+void plant_init(double ambient, unsigned seed);
+void plant_set_ambient(double t);
+void plant_set_open(uint8_t ch, uint8_t open);
+void plant_set_fan_fail(uint8_t fail);
+
+// dt seconds with the heaters on or off and the fan drive 0 .. 1
+void plant_step(double dt, const uint8_t heat[2], double fan);
+
+double plant_zone(uint8_t ch);		// deg C
+uint16_t plant_adc(uint8_t ch);		// 10 bit conversion result
+double plant_rpm(void);
+
+#endif /* PLANT_H_ */
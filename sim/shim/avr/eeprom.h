@@ -0,0 +1,28 @@
+/*
+ * avr/eeprom.h (host build shim)
+ *
+ * EEMEM variables go into their own section, sim/avrsim.c treats it as
+ * the eeprom: erased at start unless an image is loaded. Writes take no
+ * simulated time.
+ */
+
+#ifndef SHIM_AVR_EEPROM_H_
+#define SHIM_AVR_EEPROM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EEMEM __attribute__((section("sim_eeprom"), used))
+
+uint8_t eeprom_read_byte(const uint8_t *p);
+uint16_t eeprom_read_word(const uint16_t *p);
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_update_byte(uint8_t *p, uint8_t value);
+void eeprom_update_word(uint16_t *p, uint16_t value);
+void eeprom_update_block(const void *src, void *dst, size_t n);
+#define eeprom_is_ready()  1
+#define eeprom_write_byte  eeprom_update_byte
+#define eeprom_write_word  eeprom_update_word
+#define eeprom_write_block eeprom_update_block
+
+#endif /* SHIM_AVR_EEPROM_H_ */
@@ -0,0 +1,23 @@
+/*
+ * avr/interrupt.h (host build shim)
+ *
+ * An isr is a plain function named after its vector, sim/avrsim.c calls
+ * it. The I flag only decides whether the model dispatches, the firmware
+ * never runs concurrently with an isr.
+ */
+
+#ifndef SHIM_AVR_INTERRUPT_H_
+#define SHIM_AVR_INTERRUPT_H_
+
+#include <stdint.h>
+
+extern volatile uint8_t sim_sreg_i;
+
+#define sei() (sim_sreg_i = 1)
+#define cli() (sim_sreg_i = 0)
+#define reti() return
+
+#define ISR_NAKED
+#define ISR(vector, ...) void vector(void); void vector(void)
+
+#endif /* SHIM_AVR_INTERRUPT_H_ */
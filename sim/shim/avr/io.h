@@ -0,0 +1,69 @@
+/*
+ * avr/io.h (host build shim)
+ *
+ * ATtiny84 registers as plain variables, defined in sim/avrsim.c. Only
+ * what the firmware touches. TIFR1 and USISR have flags that clear when
+ * a one is written, every access goes through the model for those, and
+ * PINA follows the bus lines.
+ * 16 bit registers are little endian like on the chip.
+ */
+
+#ifndef SHIM_AVR_IO_H_
+#define SHIM_AVR_IO_H_
+
+#include <stdint.h>
+
+#define __AVR_ATtiny84__ 1
+#define E2END 0x1FF
+
+extern volatile uint8_t PORTA, DDRA, PORTB, DDRB, PINB;
+extern volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK0;
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+extern volatile uint16_t TCNT1, ICR1, OCR1A, OCR1B;
+extern volatile uint8_t ACSR, ADCSRA, ADCSRB, ADMUX, DIDR0;
+extern volatile uint16_t ADCW;
+extern volatile uint8_t USICR, USIDR;
+extern volatile uint8_t GPIOR0, GPIOR1, GPIOR2;
+extern volatile uint8_t MCUSR, WDTCSR, GIMSK, PCMSK0, PCMSK1;
+
+volatile uint8_t *sim_pina(void);
+volatile uint8_t *sim_tifr1(void);
+volatile uint8_t *sim_usisr(void);
+#define PINA  (*sim_pina())
+#define TIFR1 (*sim_tifr1())
+#define USISR (*sim_usisr())
+
+// REG_BOOT: there is no bootloader here, the run ends like on a reset (boot.h)
+void sim_boot_entry(void);
+#define BOOT_ENTRY() sim_boot_entry()
+
+#define TCNT1L (((volatile uint8_t *) &TCNT1)[0])
+#define TCNT1H (((volatile uint8_t *) &TCNT1)[1])
+#define ICR1L  (((volatile uint8_t *) &ICR1)[0])
+#define ICR1H  (((volatile uint8_t *) &ICR1)[1])
+#define OCR1AL (((volatile uint8_t *) &OCR1A)[0])
+#define OCR1AH (((volatile uint8_t *) &OCR1A)[1])
+#define OCR1BL (((volatile uint8_t *) &OCR1B)[0])
+#define OCR1BH (((volatile uint8_t *) &OCR1B)[1])
+#define ADC    ADCW
+
+#define _BV(b) (1 << (b))
+
+enum { PA0, PA1, PA2, PA3, PA4, PA5, PA6, PA7 };
+enum { PB0, PB1, PB2, PB3 };
+enum { PORTA0, PORTA1, PORTA2, PORTA3, PORTA4, PORTA5, PORTA6, PORTA7 };
+enum { PINA0, PINA1, PINA2, PINA3, PINA4, PINA5, PINA6, PINA7 };
+enum { PORTB0, PORTB1, PORTB2, PORTB3 };
+enum { PINB0, PINB1, PINB2, PINB3 };
+enum { TOIE0, OCIE0A, OCIE0B };
+enum { TOIE1, OCIE1A, OCIE1B, ICIE1 = 5 };
+enum { TOV1, OCF1A, OCF1B, ICF1 = 5 };
+enum { ADPS0, ADPS1, ADPS2, ADIE, ADIF, ADATE, ADSC, ADEN };
+enum { USITC, USICLK, USICS0, USICS1, USIWM0, USIWM1, USIOIE, USISIE };
+enum { USICNT0, USICNT1, USICNT2, USICNT3, USIDC, USIPF, USIOIF, USISIF };
+enum { PORF, EXTRF, BORF, WDRF };
+enum { WDP0, WDP1, WDP2, WDE, WDCE, WDP3, WDIE, WDIF };
+enum { PCIE0 = 4, PCIE1 = 5, INT0 = 6 };
+enum { PCINT8, PCINT9, PCINT10, PCINT11 };
+
+#endif /* SHIM_AVR_IO_H_ */
@@ -0,0 +1,14 @@
+/*
+ * avr/pgmspace.h (host build shim), flash is ordinary const data.
+ */
+
+#ifndef SHIM_AVR_PGMSPACE_H_
+#define SHIM_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *) (p))
+#define pgm_read_word(p) (*(const uint16_t *) (p))
+
+#endif /* SHIM_AVR_PGMSPACE_H_ */
@@ -0,0 +1,15 @@
+/*
+ * avr/power.h (host build shim)
+ */
+
+#ifndef SHIM_AVR_POWER_H_
+#define SHIM_AVR_POWER_H_
+
+typedef enum {
+	clock_div_1, clock_div_2, clock_div_4, clock_div_8,
+	clock_div_16, clock_div_32, clock_div_64, clock_div_128, clock_div_256
+} clock_div_t;
+
+void clock_prescale_set(clock_div_t div);
+
+#endif /* SHIM_AVR_POWER_H_ */
@@ -0,0 +1,20 @@
+/*
+ * avr/sleep.h (host build shim)
+ *
+ * Simulated time passes in sleep_cpu() only, see sim/avrsim.c.
+ */
+
+#ifndef SHIM_AVR_SLEEP_H_
+#define SHIM_AVR_SLEEP_H_
+
+#include <stdint.h>
+
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_ADC  1
+
+void set_sleep_mode(uint8_t mode);
+void sleep_enable(void);
+void sleep_disable(void);
+void sleep_cpu(void);
+
+#endif /* SHIM_AVR_SLEEP_H_ */
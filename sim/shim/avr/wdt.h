@@ -0,0 +1,23 @@
+/*
+ * avr/wdt.h (host build shim)
+ */
+
+#ifndef SHIM_AVR_WDT_H_
+#define SHIM_AVR_WDT_H_
+
+#include <stdint.h>
+
+#define WDTO_15MS  0
+#define WDTO_30MS  1
+#define WDTO_60MS  2
+#define WDTO_120MS 3
+#define WDTO_250MS 4
+#define WDTO_500MS 5
+#define WDTO_1S    6
+#define WDTO_2S    7
+
+void wdt_enable(uint8_t timeout);
+void wdt_disable(void);
+void wdt_reset(void);
+
+#endif /* SHIM_AVR_WDT_H_ */
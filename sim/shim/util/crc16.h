@@ -0,0 +1,28 @@
+/*
+ * util/crc16.h (host build shim), same results as avr-libc.
+ */
+
+#ifndef SHIM_UTIL_CRC16_H_
+#define SHIM_UTIL_CRC16_H_
+
+#include <stdint.h>
+
+static inline uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t data) {
+	uint8_t i;
+
+	crc ^= data;
+	for (i = 0; i < 8; i++)
+		crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	return crc;
+}
+
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t data) {
+	uint8_t i;
+
+	crc ^= data;
+	for (i = 0; i < 8; i++)
+		crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	return crc;
+}
+
+#endif /* SHIM_UTIL_CRC16_H_ */
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+#
+# gen_caltable.py
+#
+# Generates caltable.h, the piecewise linear sensor table used by cal.c.
+# Input of the table is the published raw value (REG_TEMP_*: adc counts * 16
+# against the 1.1 V reference), output is temperature in 1/16 deg C.
+#
+#   gen_caltable.py --sensor K --gain 20 -o ../caltable.h
+#
+# --gain is the total voltage gain in front of the adc (adc gain stage times
+# external amplifier). Thermocouples use the NIST ITS-90 inverse polynomials,
+# the reference junction is assumed to sit at --cold deg C. "linear" is for
+# amplified sensors with a fixed output in mV per deg C.
+
+import argparse
+import math
+import sys
+
+CAL_SHIFT = 9            # raw value >> CAL_SHIFT = segment
+RAW_MAX = 1 << 14        # adc counts * 16
+POINTS = (RAW_MAX >> CAL_SHIFT) + 1
+
+# NIST ITS-90, E in mV, t in deg C
+TC = {
+    'K': {
+        'forward': [-0.176004136860e-01, 0.389212049750e-01, 0.185587700320e-04,
+                    -0.994575928740e-07, 0.318409457190e-09, -0.560728448890e-12,
+                    0.560750590590e-15, -0.320207200030e-18, 0.971511471520e-22,
+                    -0.121047212750e-25],
+        'exp': (0.118597600000e0, -0.118343200000e-3, 0.126968600000e3),
+        'inverse': [
+            (20.644, [0.0, 2.508355e1, 7.860106e-2, -2.503131e-1, 8.315270e-2,
+                      -1.228034e-2, 9.804036e-4, -4.413030e-5, 1.057734e-6,
+                      -1.052755e-8]),
+            (54.886, [-1.318058e2, 4.830222e1, -1.646031, 5.464731e-2,
+                      -9.650715e-4, 8.802193e-6, -3.110810e-8]),
+        ],
+    },
+    'J': {
+        'forward': [0.0, 0.503811878150e-01, 0.304758369300e-04, -0.856810657200e-07,
+                    0.132281952950e-09, -0.170529583370e-12, 0.209480906970e-15,
+                    -0.125383953360e-18, 0.156317256970e-22],
+        'exp': None,
+        'inverse': [
+            (42.919, [0.0, 1.978425e1, -2.001204e-1, 1.036969e-2, -2.549687e-4,
+                      3.585153e-6, -5.344285e-8, 5.099890e-10]),
+            (69.553, [-3.11358187e3, 3.00543684e2, -9.94773230, 1.70276630e-1,
+                      -1.43033468e-3, 4.73886084e-6]),
+        ],
+    },
+}
+
+
+def poly(c, x):
+    return sum(k * x ** i for i, k in enumerate(c))
+
+
+def tc_forward(tc, t):
+    e = poly(tc['forward'], t)
+    if tc['exp']:
+        a0, a1, a2 = tc['exp']
+        e += a0 * math.exp(a1 * (t - a2) ** 2)
+    return e
+
+
+def tc_inverse(tc, mv):
+    for top, c in tc['inverse']:
+        if mv <= top:
+            return poly(c, max(mv, 0.0))
+    return poly(tc['inverse'][-1][1], tc['inverse'][-1][0])
+
+
+def main():
+    p = argparse.ArgumentParser()
+    p.add_argument('--sensor', choices=['K', 'J', 'linear'], default='K')
+    p.add_argument('--gain', type=float, default=20.0)
+    p.add_argument('--vref', type=float, default=1.1)
+    p.add_argument('--cold', type=float, default=25.0,
+                   help='reference junction temperature, thermocouples only')
+    p.add_argument('--mv-per-deg', type=float, default=10.0, help='linear only')
+    p.add_argument('--zero-mv', type=float, default=0.0,
+                   help='linear only, output at 0 deg C')
+    p.add_argument('-o', '--output')
+    a = p.parse_args()
+
+    rows = []
+    for i in range(POINTS):
+        raw = min(i << CAL_SHIFT, RAW_MAX - 1)
+        mv = raw / 16.0 / 1024.0 * a.vref * 1000.0 / a.gain
+        if a.sensor == 'linear':
+            t = (mv - a.zero_mv) / a.mv_per_deg
+        else:
+            tc = TC[a.sensor]
+            t = tc_inverse(tc, mv + tc_forward(tc, a.cold))
+        rows.append(max(-32768, min(32767, int(round(t * 16)))))
+
+    if a.sensor == 'linear':
+        desc = '%g mV/deg C, %g mV at 0 deg C' % (a.mv_per_deg, a.zero_mv)
+    else:
+        desc = 'type %s thermocouple, reference junction %g deg C' % (a.sensor, a.cold)
+
+    out = []
+    out.append('/*')
+    out.append(' * caltable.h')
+    out.append(' *')
+    out.append(' * Generated by tools/gen_caltable.py, do not edit.')
+    out.append(' * ' + desc + ', gain %g, vref %g V' % (a.gain, a.vref))
+    out.append(' */')
+    out.append('')
+    out.append('#ifndef CALTABLE_H_')
+    out.append('#define CALTABLE_H_')
+    out.append('')
+    out.append('#define CAL_SHIFT  %d' % CAL_SHIFT)
+    out.append('#define CAL_POINTS %d' % POINTS)
+    out.append('')
+    out.append('static const int16_t cal_table[CAL_POINTS] PROGMEM = {')
+    for i in range(0, POINTS, 8):
+        out.append('\t' + ' '.join('%d,' % v for v in rows[i:i + 8]))
+    out.append('};')
+    out.append('')
+    out.append('#endif /* CALTABLE_H_ */')
+    text = '\r\n'.join(out) + '\r\n'
+
+    if not a.output:
+        sys.stdout.write(text)
+        return
+    try:
+        with open(a.output, newline='') as f:
+            if f.read() == text:
+                return  # unchanged, don't trigger a rebuild
+    except OSError:
+        pass
+    with open(a.output, 'w', newline='') as f:
+        f.write(text)
+
+
+if __name__ == '__main__':
+    main()